@@ -0,0 +1,433 @@
+/* accesslog.c: Asynchronous Access Log */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Constants */
+
+#define ACCESSLOG_RINGS        64              /* Rings, each claimed by a thread or process */
+#define ACCESSLOG_RING_SIZE    256             /* Entries per ring (power of two) */
+#define ACCESSLOG_ENTRY_SIZE   512             /* Bytes per entry (longer lines are truncated) */
+#define ACCESSLOG_BATCH        64              /* Entries written with one writev */
+#define ACCESSLOG_INTERVAL_MS  50              /* Longest an entry waits for the writer */
+#define ACCESSLOG_BLOCK_US     100             /* Pause while waiting for room in a full ring */
+#define ACCESSLOG_STALL_MS     1000            /* Longest a reserved entry may stay unpublished */
+#define ACCESSLOG_WRITING      (1ULL << 63)    /* Sequence flag: producer is copying its line in */
+
+/* Access Log: each thread or process formats entries into a ring of its
+ * own in shared memory, and a writer thread in the main process drains
+ * every ring in batches.  So forked children log through the same writer,
+ * and serving a request costs no system call for its log line.
+ *
+ * Rings are bounded queues with a sequence number per entry (after Dmitry
+ * Vyukov's), so they stay correct without locks even when more threads or
+ * processes than ACCESSLOG_RINGS share them: producers reserve an entry by
+ * advancing tail, and publish it by setting its sequence; the writer hands
+ * entries back by advancing their sequence a lap once they are written.
+ *
+ * A producer that dies (a crashed child, say) between reserving an entry
+ * and publishing it would leave the writer waiting on that entry forever,
+ * and in block mode every later producer on its ring as well.  So once an
+ * entry has been reserved but unpublished for ACCESSLOG_STALL_MS, the
+ * writer skips it (counting it as dropped).  So that a producer that was
+ * merely slow cannot clobber the entry once the next lap has reserved it,
+ * producers format into a buffer of their own and claim the entry (with a
+ * compare-and-swap from its position to ACCESSLOG_WRITING) before copying
+ * the line in; the writer never skips an entry while it is being copied. */
+
+struct accesslog_entry {
+    uint64_t sequence;          /*< Position + 1 once published, position + size once free (or position | ACCESSLOG_WRITING while copied in) */
+    uint32_t length;
+    char     text[ACCESSLOG_ENTRY_SIZE - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+struct accesslog_ring {
+    uint64_t tail __attribute__((aligned(64)));     /*< Next position to reserve (producers) */
+    uint64_t head __attribute__((aligned(64)));     /*< Next position to write (writer) */
+    unsigned long long stalled;                     /*< When head was first seen reserved but unpublished (writer) */
+    struct accesslog_entry entries[ACCESSLOG_RING_SIZE];
+};
+
+struct accesslog {
+    unsigned int claimed;       /*< Rings handed out (modulo ACCESSLOG_RINGS) */
+    int          sleeping;      /*< Writer is waiting (futex word) */
+    int          reopen;        /*< SIGHUP arrived: reopen AccessLogPath */
+    uint64_t     dropped;       /*< Entries lost to full rings or failed writes */
+    struct accesslog_ring rings[ACCESSLOG_RINGS];
+};
+
+static struct accesslog *Log = NULL;
+static __thread struct accesslog_ring *Ring = NULL;
+static __thread time_t LogSecond = 0;       /* Second LogTime was formatted for */
+static __thread char   LogTime[32];
+
+/**
+ * Forget the parent's ring in a forked child, so it claims its own.
+ **/
+static void
+accesslog_forked(void)
+{
+    Ring = NULL;
+}
+
+/**
+ * Wake writer if it is waiting for entries.
+ **/
+static void
+accesslog_wake(void)
+{
+    if (__atomic_load_n(&Log->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&Log->sleeping, 0, __ATOMIC_ACQ_REL))
+        syscall(SYS_futex, &Log->sleeping, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Open AccessLogPath for appending ("-" is standard error).  Returns the
+ * file descriptor, or -1 on error.
+ **/
+static int
+accesslog_open(void)
+{
+    int fd;
+
+    if (streq(AccessLogPath, "-"))
+        return STDERR_FILENO;
+    if ((fd = open(AccessLogPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+        fprintf(stderr, "Unable to open access log %s: %s\n", AccessLogPath, strerror(errno));
+    return fd;
+}
+
+/**
+ * Write batch of entries with writev, then hand them back to their rings.
+ **/
+static void
+accesslog_flush(int fd, struct iovec *iov, struct accesslog_entry **taken, size_t n)
+{
+    struct iovec *next = iov;
+    size_t        left = n;
+    ssize_t       written;
+
+    while (left > 0) {
+        if ((written = writev(fd, next, left)) < 0) {
+            if (errno == EINTR)
+                continue;
+            __atomic_add_fetch(&Log->dropped, left, __ATOMIC_RELAXED);
+            break;
+        }
+        for (; left > 0 && (size_t)written >= next->iov_len; next++, left--)
+            written -= next->iov_len;
+        if (left > 0) {
+            next->iov_base  = (char *)next->iov_base + written;
+            next->iov_len  -= written;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+        __atomic_store_n(&taken[i]->sequence, taken[i]->sequence - 1 + ACCESSLOG_RING_SIZE, __ATOMIC_RELEASE);
+}
+
+/**
+ * Determine whether entry e at position head of ring, whose sequence is
+ * sequence, was reserved by a producer that has not claimed it for
+ * ACCESSLOG_STALL_MS.  If so, hand it back to the ring and count it as
+ * dropped.
+ **/
+static bool
+accesslog_skip(struct accesslog_ring *ring, struct accesslog_entry *e, uint64_t head, uint64_t sequence)
+{
+    unsigned long long now;
+
+    if (sequence != head || __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) <= head)
+        return false;   /* Not reserved yet */
+
+    now = metrics_now();
+    if (ring->stalled == 0) {
+        ring->stalled = now;
+        return false;
+    }
+    if (now - ring->stalled < ACCESSLOG_STALL_MS * 1000000ULL ||
+        !__atomic_compare_exchange_n(&e->sequence, &sequence, head + ACCESSLOG_RING_SIZE, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+
+    __atomic_add_fetch(&Log->dropped, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Write every published entry, ACCESSLOG_BATCH at a time across rings.
+ **/
+static void
+accesslog_drain(int fd)
+{
+    struct iovec            iov[ACCESSLOG_BATCH];
+    struct accesslog_entry *taken[ACCESSLOG_BATCH];
+    size_t                  n = 0;
+
+    for (size_t i = 0; i < ACCESSLOG_RINGS; i++) {
+        struct accesslog_ring *ring = &Log->rings[i];
+        uint64_t head = ring->head;
+
+        for (;;) {
+            struct accesslog_entry *e = &ring->entries[head & (ACCESSLOG_RING_SIZE - 1)];
+            uint64_t sequence = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+
+            if (sequence != head + 1) {
+                if (!accesslog_skip(ring, e, head, sequence))
+                    break;
+                head++;
+                ring->stalled = 0;
+                continue;
+            }
+            ring->stalled = 0;
+            if (n == ACCESSLOG_BATCH) {
+                accesslog_flush(fd, iov, taken, n);
+                n = 0;
+            }
+            iov[n].iov_base = e->text;
+            iov[n].iov_len  = e->length;
+            taken[n++]      = e;
+            head++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELAXED);
+    }
+
+    if (n > 0)
+        accesslog_flush(fd, iov, taken, n);
+}
+
+/**
+ * Writer thread: drain the rings every ACCESSLOG_INTERVAL_MS (or sooner,
+ * when a ring fills up), and reopen the log after SIGHUP, so it can be
+ * rotated by renaming it and sending SIGHUP.
+ **/
+static void *
+accesslog_writer(void *arg)
+{
+    struct timespec interval = { .tv_nsec = ACCESSLOG_INTERVAL_MS * 1000000L };
+    int fd = (int)(intptr_t)arg;
+    int reopened;
+
+    while (true) {
+        accesslog_drain(fd);
+
+        if (__atomic_exchange_n(&Log->reopen, 0, __ATOMIC_ACQ_REL) && fd != STDERR_FILENO) {
+            if ((reopened = accesslog_open()) >= 0) {
+                close(fd);
+                fd = reopened;
+            }
+        }
+
+        __atomic_store_n(&Log->sleeping, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &Log->sleeping, FUTEX_WAIT, 1, &interval, NULL, 0);
+        __atomic_store_n(&Log->sleeping, 0, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Map rings into memory shared with every process forked from now on, and
+ * start the writer thread in this process.  Until this is called (or if
+ * AccessLogPath is empty), nothing is logged.  Returns false on error.
+ **/
+bool
+accesslog_init(void)
+{
+    pthread_t thread;
+    sigset_t  all, old;
+    int       fd, status;
+
+    if (*AccessLogPath == '\0')
+        return true;
+    if ((fd = accesslog_open()) < 0)
+        return false;
+
+    Log = mmap(NULL, sizeof(struct accesslog), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Log == MAP_FAILED) {
+        fprintf(stderr, "Unable to map access log: %s\n", strerror(errno));
+        goto fail;
+    }
+    for (size_t i = 0; i < ACCESSLOG_RINGS; i++) {
+        for (size_t j = 0; j < ACCESSLOG_RING_SIZE; j++)
+            Log->rings[i].entries[j].sequence = j;
+    }
+
+    /* Leave signals to the threads that serve requests */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    status = pthread_create(&thread, NULL, accesslog_writer, (void *)(intptr_t)fd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        fprintf(stderr, "Unable to create access log writer: %s\n", strerror(status));
+        munmap(Log, sizeof(struct accesslog));
+        goto fail;
+    }
+    pthread_detach(thread);
+    pthread_atfork(NULL, NULL, accesslog_forked);
+    return true;
+
+fail:
+    Log = NULL;
+    if (fd != STDERR_FILENO)
+        close(fd);
+    return false;
+}
+
+/**
+ * SIGHUP handler: request the access log be reopened.
+ **/
+void
+accesslog_hangup(int signum)
+{
+    if (Log)
+        __atomic_store_n(&Log->reopen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Return number of entries dropped so far.
+ **/
+unsigned long long
+accesslog_dropped(void)
+{
+    return Log ? __atomic_load_n(&Log->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+/**
+ * Copy s to p (stopping at end), escaping quotes, backslashes and control
+ * characters if escape is set.  Returns the new end of p.
+ **/
+static char *
+accesslog_copy(char *p, char *end, const char *s, bool escape)
+{
+    for (; *s && p < end; s++) {
+        unsigned char c = *s;
+
+        if (!escape || (c >= 0x20 && c != 0x7f && c != '"' && c != '\\')) {
+            *p++ = c;
+        } else if (end - p >= 4) {
+            p += snprintf(p, 5, "\\x%02x", c);
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+/**
+ * Format request's entry in the Combined Log Format into text (of size
+ * bytes, including its newline), and return its length.  The size is the
+ * number of bytes in the response, headers included.
+ **/
+static size_t
+accesslog_format(struct request *r, http_status status, char *text, size_t size)
+{
+    char  *p = text, *end = text + size - 1;
+    char   name[NI_MAXHOST];
+    char   numbers[64];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != LogSecond) {
+        localtime_r(&now, &tm);
+        strftime(LogTime, sizeof(LogTime), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        LogSecond = now;
+    }
+    resolve_host(r->host, name, sizeof(name));
+
+    p = accesslog_copy(p, end, name, true);
+    p = accesslog_copy(p, end, " - - [", false);
+    p = accesslog_copy(p, end, LogTime, false);
+    p = accesslog_copy(p, end, "] \"", false);
+    if (r->method && r->uri) {
+        p = accesslog_copy(p, end, r->method, true);
+        p = accesslog_copy(p, end, " ", false);
+        p = accesslog_copy(p, end, r->uri, true);
+        if (r->query && *r->query) {
+            p = accesslog_copy(p, end, "?", false);
+            p = accesslog_copy(p, end, r->query, true);
+        }
+        snprintf(numbers, sizeof(numbers), " HTTP/1.%d", r->version);
+        p = accesslog_copy(p, end, numbers, false);
+    } else {
+        p = accesslog_copy(p, end, "-", false);
+    }
+    snprintf(numbers, sizeof(numbers), "\" %.3s %llu \"", http_status_string(status), r->sent);
+    p = accesslog_copy(p, end, numbers, false);
+    p = accesslog_copy(p, end, request_header(r, HEADER_REFERER) ? request_header(r, HEADER_REFERER) : "-", true);
+    p = accesslog_copy(p, end, "\" \"", false);
+    p = accesslog_copy(p, end, request_header(r, HEADER_USER_AGENT) ? request_header(r, HEADER_USER_AGENT) : "-", true);
+    p = accesslog_copy(p, end, "\"", false);
+
+    *p++ = '\n';
+    return p - text;
+}
+
+/**
+ * Log request answered with status.
+ *
+ * If the ring of the calling thread is full, the entry is dropped (and
+ * counted) unless AccessLogBlock is set, in which case this waits for the
+ * writer to make room.
+ **/
+void
+accesslog_request(struct request *r, http_status status)
+{
+    struct accesslog_entry *e;
+    uint64_t position;
+    int64_t  lag;
+    char     text[sizeof(e->text)];
+    size_t   length;
+
+    if (Log == NULL)
+        return;
+    if (Ring == NULL)
+        Ring = &Log->rings[__atomic_fetch_add(&Log->claimed, 1, __ATOMIC_RELAXED) % ACCESSLOG_RINGS];
+
+    /* Reserve entry */
+    position = __atomic_load_n(&Ring->tail, __ATOMIC_RELAXED);
+    while (true) {
+        e   = &Ring->entries[position & (ACCESSLOG_RING_SIZE - 1)];
+        lag = (int64_t)(__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&Ring->tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (lag < 0) {
+            /* Full: the entry a lap behind has not been written yet */
+            if (!AccessLogBlock) {
+                __atomic_add_fetch(&Log->dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            accesslog_wake();
+            usleep(ACCESSLOG_BLOCK_US);
+            position = __atomic_load_n(&Ring->tail, __ATOMIC_RELAXED);
+        } else {
+            position = __atomic_load_n(&Ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Format entry, then claim it (unless the writer gave up on it), copy
+     * it in and publish it, waking the writer early once the ring is half
+     * full */
+    length = accesslog_format(r, status, text, sizeof(text));
+    if (!__atomic_compare_exchange_n(&e->sequence, &position, position | ACCESSLOG_WRITING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    memcpy(e->text, text, length);
+    e->length = length;
+    __atomic_store_n(&e->sequence, position + 1, __ATOMIC_RELEASE);
+
+    if (position + 1 - __atomic_load_n(&Ring->head, __ATOMIC_RELAXED) >= ACCESSLOG_RING_SIZE / 2)
+        accesslog_wake();
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
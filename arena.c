@@ -0,0 +1,91 @@
+/* arena.c: Bump Allocator */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Overflow Chunk */
+
+struct arena_chunk {
+    struct arena_chunk *next;   /*< Previously allocated chunk */
+    size_t              size;   /*< Usable bytes in data */
+    char                data[]; /*< Allocations */
+};
+
+#define ARENA_ALIGN	(sizeof(void *))
+
+/**
+ * Initialize arena over caller-owned storage.
+ **/
+void
+arena_init(struct arena *a, char *storage, size_t capacity)
+{
+    a->storage  = storage;
+    a->capacity = capacity;
+    a->base     = storage;
+    a->size     = capacity;
+    a->used     = 0;
+    a->chunks   = NULL;
+}
+
+/**
+ * Allocate size bytes (aligned for any pointer) from arena.
+ *
+ * Allocations come from the arena's storage until it is full, after which
+ * they come from overflow chunks on the heap.  Returns NULL if out of
+ * memory.
+ **/
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t used = (a->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (used + size <= a->size) {
+        a->used = used + size;
+        return a->base + used;
+    }
+
+    /* Start a new chunk (at least as big as the arena's own storage) */
+    if ((chunk = malloc(sizeof(struct arena_chunk) + (size > a->capacity ? size : a->capacity))) == NULL)
+        return NULL;
+
+    chunk->next = a->chunks;
+    chunk->size = size > a->capacity ? size : a->capacity;
+    a->chunks   = chunk;
+    a->base     = chunk->data;
+    a->size     = chunk->size;
+    a->used     = size;
+    return chunk->data;
+}
+
+/**
+ * Copy string into arena.
+ **/
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+    size_t length = strlen(s) + 1;
+    char  *copy   = arena_alloc(a, length);
+
+    if (copy != NULL)
+        memcpy(copy, s, length);
+    return copy;
+}
+
+/**
+ * Release every allocation, freeing any overflow chunks.
+ **/
+void
+arena_reset(struct arena *a)
+{
+    struct arena_chunk *chunk;
+
+    while ((chunk = a->chunks) != NULL) {
+        a->chunks = chunk->next;
+        free(chunk);
+    }
+    arena_init(a, a->storage, a->capacity);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
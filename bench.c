@@ -0,0 +1,389 @@
+/* bench.c: Request Pipeline Microbenchmarks */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define BENCH_TIME_NS   (200*1000*1000ULL)  /* Minimum time measured per benchmark */
+#define BENCH_MAX_ITER  (100*1000*1000ULL)
+#define HELLO_SCRIPT    "#!/bin/sh\nprintf 'Content-Type: text/plain\\r\\n\\r\\nhello\\n'\n"
+
+/* Allocation Counting: spidey-bench is linked with --wrap for each
+ * allocator the server's own code calls, so those calls (and not those made
+ * inside libc, zlib or by the drain thread) come through these wrappers,
+ * which count them while the calling thread is measuring a benchmark */
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t n, size_t size);
+extern void *__real_realloc(void *p, size_t size);
+extern char *__real_strdup(const char *s);
+extern FILE *__real_open_memstream(char **buffer, size_t *size);
+
+static unsigned long long Allocations = 0;
+static __thread bool      Measuring   = false;
+
+static inline void
+bench_count(void)
+{
+    if (Measuring)
+        __atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *
+__wrap_malloc(size_t size)
+{
+    bench_count();
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    bench_count();
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+    bench_count();
+    return __real_realloc(p, size);
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+    bench_count();
+    return __real_strdup(s);
+}
+
+int
+__wrap_asprintf(char **s, const char *format, ...)
+{
+    va_list args;
+    int     n;
+
+    bench_count();
+    va_start(args, format);
+    n = vasprintf(s, format, args);
+    va_end(args);
+    return n;
+}
+
+FILE *
+__wrap_open_memstream(char **buffer, size_t *size)
+{
+    bench_count();
+    return __real_open_memstream(buffer, size);
+}
+
+/* Fixture: a generated www tree and a request on one end of a socketpair,
+ * whose other end is written by the benchmarks and drained by a thread */
+
+static char             Root[64];
+static char             FilePath[PATH_MAX];
+static char             DirectoryPath[PATH_MAX];
+static char             ScriptPath[PATH_MAX];
+static struct request  *Request;
+static int              Client = -1;
+static pthread_t        Drainer;
+static struct arena     Arena;
+static char             ArenaStorage[REQUEST_ARENA_SIZE];
+
+static void
+bench_file(const char *name, size_t size, const char *fill, mode_t mode)
+{
+    char  path[PATH_MAX];
+    FILE *fs;
+    size_t n = strlen(fill);
+
+    snprintf(path, sizeof(path), "%s/%s", Root, name);
+    if ((fs = fopen(path, "w")) == NULL) {
+        fatal("Unable to create %s: %s", path, strerror(errno));
+    }
+    for (size_t i = 0; i < size; i += n)
+        fwrite(fill, 1, size - i < n ? size - i : n, fs);
+    fclose(fs);
+    chmod(path, mode);
+}
+
+static void *
+bench_drain(void *arg)
+{
+    char buffer[RESPONSE_BUFFER_SIZE];
+
+    while (read(Client, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+static void
+bench_setup(void)
+{
+    char path[PATH_MAX];
+    int  fds[2];
+
+    snprintf(Root, sizeof(Root), "/tmp/spidey-bench.XXXXXX");
+    if (mkdtemp(Root) == NULL) {
+        fatal("Unable to create benchmark tree: %s", strerror(errno));
+    }
+    RootPath = Root;
+
+    /* One connection serves every iteration, and never waits on the client */
+    KeepAliveRequests = 0;
+    HeaderTimeout     = 0;
+    BodyTimeout       = 0;
+    SendTimeout       = 0;
+
+    bench_file("index.html", 2*1024, "<p>Spidey benchmark page</p>\n", 0644);
+    bench_file("style.css", 20*1024, "body { margin: 0; padding: 0; }\n", 0644);
+    bench_file("large.bin", 4*1024*1024, "\x01\x02\x03\x04\x05\x06\x07\x08", 0644);
+
+    snprintf(path, sizeof(path), "%s/dir", Root);
+    mkdir(path, 0755);
+    for (int i = 0; i < 200; i++) {
+        snprintf(path, sizeof(path), "dir/file%03d.txt", i);
+        bench_file(path, 16, "0123456789abcdef", 0644);
+    }
+
+    snprintf(path, sizeof(path), "%s/scripts", Root);
+    mkdir(path, 0755);
+    bench_file("scripts/hello.sh", strlen(HELLO_SCRIPT), HELLO_SCRIPT, 0755);
+
+    snprintf(FilePath, sizeof(FilePath), "%s/index.html", Root);
+    snprintf(DirectoryPath, sizeof(DirectoryPath), "%s/dir", Root);
+    snprintf(ScriptPath, sizeof(ScriptPath), "%s/scripts/hello.sh", Root);
+
+    mime_load();
+    metrics_init();
+    accesslog_init();
+    arena_init(&Arena, ArenaStorage, sizeof(ArenaStorage));
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0 || (Request = open_request(fds[0])) == NULL) {
+        fatal("Unable to open request: %s", strerror(errno));
+    }
+    Client = fds[1];
+    pthread_create(&Drainer, NULL, bench_drain, NULL);
+}
+
+static int
+bench_remove(const char *path, const struct stat *s, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void
+bench_teardown(void)
+{
+    free_request(Request);      /* Closes server end: drainer sees EOF */
+    pthread_join(Drainer, NULL);
+    close(Client);
+    nftw(Root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Benchmarks */
+
+static void
+bench_send(const char *text)
+{
+    size_t length = strlen(text);
+
+    for (size_t sent = 0; sent < length; ) {
+        ssize_t n = write(Client, text + sent, length - sent);
+        if (n <= 0) {
+            fatal("Unable to write request: %s", strerror(errno));
+        }
+        sent += n;
+    }
+}
+
+static void
+bench_parse_request(const void *arg)
+{
+    bench_send(arg);
+    parse_request(Request);
+    reset_request(Request);
+}
+
+/* Parse a request already in the receive buffer: no system calls, so the
+ * scanner's share of the time shows */
+static void
+bench_parse_buffer(const void *arg)
+{
+    size_t length = strlen(arg);
+
+    memcpy(Request->buffer, arg, length);
+    Request->length = length;
+    read_request(Request);
+    reset_request(Request);
+}
+
+static void
+bench_handle_request(const void *arg)
+{
+    bench_send(arg);
+    handle_request(Request);
+    response_drain(Request);
+    reset_request(Request);
+}
+
+static void
+bench_determine_mimetype(const void *arg)
+{
+    determine_mimetype(&Arena, arg);
+    arena_reset(&Arena);
+}
+
+static void
+bench_determine_request_path(const void *arg)
+{
+    determine_request_path(&Arena, arg);
+    arena_reset(&Arena);
+}
+
+static void
+bench_determine_request_type(const void *arg)
+{
+    determine_request_type(arg);
+}
+
+#define GET(uri, headers)   "GET " uri " HTTP/1.1\r\nHost: localhost\r\n" headers "\r\n"
+#define CURL_HEADERS        "User-Agent: curl/8.5.0\r\n" \
+                            "Accept: */*\r\n"
+#define CHROME_HEADERS      "Connection: keep-alive\r\n" \
+                            "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n" \
+                            "sec-ch-ua-mobile: ?0\r\n" \
+                            "sec-ch-ua-platform: \"Linux\"\r\n" \
+                            "Upgrade-Insecure-Requests: 1\r\n" \
+                            "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n" \
+                            "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n" \
+                            "Sec-Fetch-Site: same-origin\r\n" \
+                            "Sec-Fetch-Mode: navigate\r\n" \
+                            "Sec-Fetch-User: ?1\r\n" \
+                            "Sec-Fetch-Dest: document\r\n" \
+                            "Referer: http://localhost/docs/index.html\r\n" \
+                            "Accept-Encoding: gzip, deflate, br, zstd\r\n" \
+                            "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n" \
+                            "Cookie: _ga=GA1.1.1234567890.1700000000; _ga_XYZ123=GS1.1.1700000000.3.1.1700000300.0.0.0; " \
+                            "session=eyJ1c2VyIjoic3BpZGV5IiwiZXhwIjoxNzAwMDAwMDAwfQ.c2lnbmF0dXJlLXBsYWNlaG9sZGVy; " \
+                            "csrftoken=0123456789abcdef0123456789abcdef; theme=dark; lang=en-US; consent=analytics%3Dfalse%26ads%3Dfalse\r\n"
+#define BROWSER_HEADERS     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n" \
+                            "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n" \
+                            "Accept-Language: en-US,en;q=0.5\r\n" \
+                            "Accept-Encoding: gzip, deflate, br\r\n" \
+                            "Referer: http://localhost/\r\n" \
+                            "Cookie: session=0123456789abcdef; theme=dark\r\n" \
+                            "Connection: keep-alive\r\n"
+
+/* Parse each header set with each scanner in turn */
+#define PARSE_SCANNERS(name, request) \
+    { "parse_buffer/" name "/avx2",     bench_parse_buffer, request, "avx2" },   \
+    { "parse_buffer/" name "/sse4.2",   bench_parse_buffer, request, "sse4.2" }, \
+    { "parse_buffer/" name "/scalar",   bench_parse_buffer, request, "scalar" }
+
+static const struct benchmark {
+    const char *name;
+    void      (*run)(const void *arg);
+    const void *arg;
+    const char *scanner;    /* Scanner to force (NULL = fastest supported) */
+} Benchmarks[] = {
+    { "parse_request/minimal",          bench_parse_request,          GET("/index.html", "") },
+    { "parse_request/browser",          bench_parse_request,          GET("/index.html?q=spidey&page=2", BROWSER_HEADERS) },
+    PARSE_SCANNERS("curl",              GET("/", CURL_HEADERS)),
+    PARSE_SCANNERS("firefox",           GET("/index.html?q=spidey&page=2", BROWSER_HEADERS)),
+    PARSE_SCANNERS("chrome",            GET("/docs/guide.html", CHROME_HEADERS)),
+    { "determine_mimetype/html",        bench_determine_mimetype,     "/www/index.html" },
+    { "determine_mimetype/unknown",     bench_determine_mimetype,     "/www/README" },
+    { "determine_request_path/file",    bench_determine_request_path, "/index.html" },
+    { "determine_request_path/missing", bench_determine_request_path, "/missing.html" },
+    { "determine_request_type/file",    bench_determine_request_type, FilePath },
+    { "determine_request_type/directory", bench_determine_request_type, DirectoryPath },
+    { "determine_request_type/script",  bench_determine_request_type, ScriptPath },
+    { "handle_request/cached_file",     bench_handle_request,         GET("/index.html", "") },
+    { "handle_request/gzip_file",       bench_handle_request,         GET("/style.css", "Accept-Encoding: gzip\r\n") },
+    { "handle_request/not_modified",    bench_handle_request,         GET("/index.html", "If-Modified-Since: Fri, 31 Dec 9999 23:59:59 GMT\r\n") },
+    { "handle_request/range",           bench_handle_request,         GET("/style.css", "Range: bytes=0-99,1000-1099\r\n") },
+    { "handle_request/large_file",      bench_handle_request,         GET("/large.bin", "") },
+    { "handle_request/directory",       bench_handle_request,         GET("/dir", "") },
+    { "handle_request/not_found",       bench_handle_request,         GET("/missing.html", "") },
+    { "handle_request/metrics",         bench_handle_request,         GET("/metrics", "") },
+    { "handle_request/cgi",             bench_handle_request,         GET("/scripts/hello.sh?name=spidey", "") },
+};
+
+/**
+ * Run benchmark in batches of growing size until a batch lasts at least
+ * BENCH_TIME_NS, and report that batch as a JSON object.  Returns false
+ * (reporting nothing) if the benchmark's scanner is not supported here.
+ **/
+static bool
+bench_run(const struct benchmark *b, FILE *out, bool first)
+{
+    unsigned long long n = 1, ns, allocations;
+
+    if (scan_select(b->scanner) == NULL)
+        return false;
+    b->run(b->arg);     /* Warm up caches */
+
+    for (;;) {
+        unsigned long long start = metrics_now();
+
+        allocations = __atomic_load_n(&Allocations, __ATOMIC_RELAXED);
+        Measuring   = true;
+        for (unsigned long long i = 0; i < n; i++)
+            b->run(b->arg);
+        Measuring   = false;
+        allocations = __atomic_load_n(&Allocations, __ATOMIC_RELAXED) - allocations;
+        ns          = metrics_now() - start;
+
+        if (ns >= BENCH_TIME_NS || n >= BENCH_MAX_ITER)
+            break;
+        n = ns == 0 ? n * 100 : n * 2 > n * BENCH_TIME_NS * 6 / 5 / ns ? n * 2 : n * BENCH_TIME_NS * 6 / 5 / ns;
+    }
+
+    fprintf(out, "%s    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+            first ? "" : ",\n", b->name, n, (double)ns / n, (double)allocations / n);
+    fflush(out);
+    scan_select(NULL);
+    return true;
+}
+
+/* Main Execution */
+
+int
+main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+    bool first = true;
+
+    signal(SIGPIPE, SIG_IGN);
+    bench_setup();
+
+    /* Server logging would dominate the results: discard it */
+    if (freopen("/dev/null", "w", stderr) == NULL)
+        return EXIT_FAILURE;
+
+    printf("{\n  \"scanner\": \"%s\",\n  \"benchmarks\": [\n", scan_select(NULL));
+    for (size_t i = 0; i < sizeof(Benchmarks) / sizeof(Benchmarks[0]); i++) {
+        if (strstr(Benchmarks[i].name, filter) && bench_run(&Benchmarks[i], stdout, first))
+            first = false;
+    }
+    printf("\n  ]\n}\n");
+
+    bench_teardown();
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,379 @@
+/* cache.c: Static File Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+/* Constants */
+
+#define CACHE_BUCKETS	1024
+#define CACHE_FILE_MAX	(CacheBytes / 8)    /* Largest file worth caching */
+
+/* Cache */
+
+struct cache {
+    struct cache_entry *buckets[CACHE_BUCKETS]; /*< Hash chains keyed by path */
+    struct cache_entry *head;                   /*< Least recently used entry */
+    struct cache_entry *tail;                   /*< Most recently used entry */
+    size_t              bytes;                  /*< Bytes held by cached entries */
+    pthread_mutex_t     lock;
+};
+
+static struct cache Cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+cache_free(struct cache_entry *e)
+{
+    free(e->path);
+    free(e->headers);
+    free(e->body);
+    free(e->mimetype);
+    free(e->gzip_headers);
+    free(e->gzip);
+    free(e);
+}
+
+/**
+ * Move entry to the most recently used end of the LRU list.
+ **/
+static void
+cache_touch(struct cache_entry *e)
+{
+    if (Cache.tail == e)
+        return;
+
+    /* Unlink */
+    if (e->prev)
+        e->prev->next = e->next;
+    else if (Cache.head == e)
+        Cache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+
+    /* Append */
+    e->next = NULL;
+    e->prev = Cache.tail;
+    if (Cache.tail)
+        Cache.tail->next = e;
+    else
+        Cache.head = e;
+    Cache.tail = e;
+}
+
+/**
+ * Remove entry from the cache (must hold Cache.lock).
+ *
+ * The entry itself is freed once the last request using it releases it.
+ **/
+static void
+cache_evict(struct cache_entry *e)
+{
+    struct cache_entry **link = &Cache.buckets[hash_string(e->path, false) % CACHE_BUCKETS];
+
+    while (*link != e)
+        link = &(*link)->chain;
+    *link = e->chain;
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        Cache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        Cache.tail = e->prev;
+
+    Cache.bytes -= e->length + e->gzip_length;
+    e->cached    = false;
+    if (e->refs == 0)
+        cache_free(e);
+}
+
+/**
+ * Check whether entry still describes the file at its path.
+ **/
+static bool
+cache_valid(struct cache_entry *e)
+{
+    struct stat s;
+
+    return stat(e->path, &s) == 0 &&
+           s.st_dev  == e->dev  && s.st_ino  == e->ino && s.st_size == (off_t)e->size &&
+           s.st_mtim.tv_sec  == e->mtime.tv_sec  && s.st_mtim.tv_nsec == e->mtime.tv_nsec &&
+           s.st_ctim.tv_sec  == e->ctime.tv_sec  && s.st_ctim.tv_nsec == e->ctime.tv_nsec;
+}
+
+/**
+ * Look up cached file by resolved path.
+ *
+ * Entries are revalidated against the filesystem at most once every
+ * CacheRevalidate seconds; stale entries are evicted.  Returns the entry,
+ * which must be released with cache_release, or NULL if the file is not
+ * cached.
+ **/
+struct cache_entry *
+cache_lookup(const char *path)
+{
+    struct cache_entry *e;
+    time_t now;
+    bool   revalidate;
+
+    if (CacheBytes == 0)
+        return NULL;
+
+    pthread_mutex_lock(&Cache.lock);
+    for (e = Cache.buckets[hash_string(path, false) % CACHE_BUCKETS]; e && !streq(e->path, path); e = e->chain);
+    if (e == NULL) {
+        pthread_mutex_unlock(&Cache.lock);
+        return NULL;
+    }
+
+    now = metrics_now() / 1000000000ULL;
+    revalidate = now - e->checked >= (time_t)CacheRevalidate;
+    if (revalidate)
+        e->checked = now;   /* Other requests keep using the entry meanwhile */
+    e->refs++;
+    cache_touch(e);
+    pthread_mutex_unlock(&Cache.lock);
+
+    if (revalidate && !cache_valid(e)) {
+        debug("Cache entry for %s is stale", path);
+        pthread_mutex_lock(&Cache.lock);
+        if (e->cached)
+            cache_evict(e);
+        pthread_mutex_unlock(&Cache.lock);
+        cache_release(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+/**
+ * Add body rendered for path to the cache, given the fstat (or stat) of
+ * path and the body's mimetype.  If it succeeds, the cache takes over body,
+ * which must have been allocated with malloc.
+ *
+ * The entry is built along with its response headers (which carry its
+ * validators, and Vary: Accept-Encoding if it is worth compressing), and
+ * least recently used entries are evicted to keep the cache within
+ * CacheBytes.  The entry stays valid while path keeps the identity and
+ * version in s.  Returns the entry, which must be released with
+ * cache_release, or NULL if the body is not cacheable (body then still
+ * belongs to the caller).
+ **/
+struct cache_entry *
+cache_store(const char *path, const struct stat *s, const char *mimetype, char *body, size_t length)
+{
+    struct cache_entry *e, **bucket;
+
+    if (CacheBytes == 0 || length > CACHE_FILE_MAX)
+        return NULL;
+
+    if ((e = calloc(1, sizeof(struct cache_entry))) == NULL) {
+        fprintf(stderr, "Unable to cache %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    conditional_init(&e->validators, s->st_ino, length, &s->st_mtim);
+
+    if ((e->path = strdup(path)) == NULL ||
+        (e->mimetype = strdup(mimetype)) == NULL ||
+        asprintf(&e->headers, "HTTP/1.1 %s\r\nContent-Type: %s\r\nETag: %s\r\nLast-Modified: %s\r\n%sContent-Length: %zu\r\nConnection: ",
+                 http_status_string(HTTP_STATUS_OK), mimetype, e->validators.etag, e->validators.modified,
+                 compress_worthy(mimetype, length) ? "Vary: Accept-Encoding\r\n" : "", length) < 0) {
+        fprintf(stderr, "Unable to cache %s: %s\n", path, strerror(errno));
+        cache_free(e);
+        return NULL;
+    }
+    e->hlength = strlen(e->headers);
+    e->compressible = compress_worthy(mimetype, length);
+
+    e->body    = body;
+    e->length  = length;
+    e->size    = s->st_size;
+    e->regular = S_ISREG(s->st_mode);
+    e->dev     = s->st_dev;
+    e->ino     = s->st_ino;
+    e->mtime   = s->st_mtim;
+    e->ctime   = s->st_ctim;
+    e->checked = metrics_now() / 1000000000ULL;
+    e->refs    = 1;
+    e->cached  = true;
+
+    pthread_mutex_lock(&Cache.lock);
+
+    /* Replace any entry another request cached meanwhile */
+    bucket = &Cache.buckets[hash_string(path, false) % CACHE_BUCKETS];
+    for (struct cache_entry *old = *bucket; old; old = old->chain) {
+        if (streq(old->path, path)) {
+            cache_evict(old);
+            break;
+        }
+    }
+
+    while (Cache.head && Cache.bytes + length > CacheBytes)
+        cache_evict(Cache.head);
+
+    e->chain = *bucket;
+    *bucket  = e;
+    e->prev  = Cache.tail;
+    if (Cache.tail)
+        Cache.tail->next = e;
+    else
+        Cache.head = e;
+    Cache.tail   = e;
+    Cache.bytes += length;
+
+    pthread_mutex_unlock(&Cache.lock);
+
+    debug("Cached %s (%zu bytes, %zu cached)", path, length, Cache.bytes);
+    return e;
+}
+
+/**
+ * Add file to the cache, given its open descriptor, its fstat and its
+ * mimetype.
+ *
+ * The whole file is read into memory and stored with cache_store.  Returns
+ * the entry, which must be released with cache_release, or NULL if the
+ * file is not cacheable.
+ **/
+struct cache_entry *
+cache_insert(const char *path, int fd, const struct stat *s, const char *mimetype)
+{
+    struct cache_entry *e;
+    size_t  length = s->st_size;
+    ssize_t nread;
+    char   *body;
+
+    if (CacheBytes == 0 || !S_ISREG(s->st_mode) || length > CACHE_FILE_MAX)
+        return NULL;
+
+    if ((body = malloc(length ? length : 1)) == NULL) {
+        fprintf(stderr, "Unable to cache %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    for (size_t offset = 0; offset < length; offset += nread) {
+        if ((nread = pread(fd, body + offset, length - offset, offset)) <= 0) {
+            free(body);
+            return NULL;    /* File changed under us: serve it uncached */
+        }
+    }
+
+    if ((e = cache_store(path, s, mimetype, body, length)) == NULL)
+        free(body);
+    return e;
+}
+
+/**
+ * Load the precompressed sibling of entry's file, if there is a fresh one
+ * small enough to cache.  Returns its contents and stores its length in
+ * length, or returns NULL.
+ **/
+static char *
+cache_sibling(struct cache_entry *e, size_t *length)
+{
+    struct stat s;
+    char   *data = NULL;
+    ssize_t nread = 0;
+    int     fd;
+
+    if ((fd = compress_sibling(e->path, &e->mtime, &s)) < 0)
+        return NULL;
+
+    if ((size_t)s.st_size <= CACHE_FILE_MAX && (data = malloc(s.st_size ? s.st_size : 1)) != NULL) {
+        for (off_t offset = 0; offset < s.st_size; offset += nread) {
+            if ((nread = pread(fd, data + offset, s.st_size - offset, offset)) <= 0) {
+                free(data);
+                data = NULL;
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    *length = s.st_size;
+    return data;
+}
+
+/**
+ * Make sure entry has its gzip variant: the file's precompressed .gz
+ * sibling if there is a fresh one (for regular files), otherwise its body
+ * compressed once here.
+ *
+ * The variant counts towards CacheBytes like the body.  Compression happens
+ * outside the lock (if two requests race, the first result is kept).
+ * Returns whether the variant exists, which it does not for entries not
+ * worth compressing or that did not get any smaller.
+ **/
+bool
+cache_compress(struct cache_entry *e)
+{
+    char  *gzip, *headers = NULL;
+    size_t length = 0;
+    bool   compressed;
+
+    pthread_mutex_lock(&Cache.lock);
+    compressed = e->compressed;
+    pthread_mutex_unlock(&Cache.lock);
+    if (compressed)
+        return e->gzip != NULL;
+    if (!e->compressible)
+        return false;
+
+    if (!e->regular || (gzip = cache_sibling(e, &length)) == NULL)
+        gzip = compress_buffer(e->body, e->length, &length);
+    if (gzip && (length >= e->length ||
+        asprintf(&headers, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\nETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\nContent-Length: %zu\r\nConnection: ",
+                 http_status_string(HTTP_STATUS_OK), e->mimetype, e->validators.gzip_etag, e->validators.modified, length) < 0)) {
+        free(gzip);
+        gzip = headers = NULL;
+    }
+
+    pthread_mutex_lock(&Cache.lock);
+    if (e->compressed) {
+        free(gzip);
+        free(headers);
+    } else {
+        e->compressed = true;
+        if (gzip) {
+            e->gzip         = gzip;
+            e->gzip_length  = length;
+            e->gzip_headers = headers;
+            e->gzip_hlength = strlen(headers);
+            if (e->cached) {
+                Cache.bytes += length;
+                while (Cache.head && Cache.bytes > CacheBytes)
+                    cache_evict(Cache.head);
+            }
+            debug("Compressed %s (%zu to %zu bytes)", e->path, e->length, length);
+        }
+    }
+    compressed = e->gzip != NULL;
+    pthread_mutex_unlock(&Cache.lock);
+
+    return compressed;
+}
+
+/**
+ * Release entry returned by cache_lookup or cache_insert.
+ **/
+void
+cache_release(struct cache_entry *e)
+{
+    pthread_mutex_lock(&Cache.lock);
+    if (--e->refs == 0 && !e->cached)
+        cache_free(e);
+    pthread_mutex_unlock(&Cache.lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
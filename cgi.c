@@ -0,0 +1,659 @@
+/* cgi.c: CGI Scripts and FastCGI Worker Pools */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* FastCGI Protocol (https://fastcgi-archives.github.io/FastCGI_Specification.html) */
+
+#define FCGI_VERSION_1      1
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+#define FCGI_STDERR         7
+#define FCGI_RESPONDER      1
+#define FCGI_KEEP_CONN      1
+#define FCGI_HEADER_SIZE    8
+#define FCGI_RECORD_MAX     65535
+#define FCGI_REQUEST_ID     1       /* Connections carry one request at a time */
+#define FCGI_TIMEOUT        60      /* Seconds to wait for a worker's output */
+
+/* Worker Pools */
+
+struct fcgi_pool {
+    char               *path;           /*< Script */
+    struct sockaddr_un  addr;           /*< Abstract socket the workers accept on */
+    socklen_t           addrlen;
+    int                 lfd;            /*< Listening socket (kept to respawn workers) */
+    pid_t              *pids;           /*< Worker processes */
+    size_t              nworkers;
+    int                *idle;           /*< Idle connections (one slot per worker) */
+    size_t              nidle;
+    size_t              connections;    /*< Open connections, idle or busy */
+    pthread_cond_t      available;      /*< Signalled when a connection is released */
+    struct fcgi_pool   *next;
+};
+
+struct fcgi_pools {
+    struct fcgi_pool   *head;
+    unsigned long       count;          /*< Pools started (names sockets) */
+    pthread_mutex_t     lock;
+};
+
+static struct fcgi_pools Pools = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Running Script */
+
+struct cgi {
+    int               fd;           /*< Script's stdout pipe, or FastCGI connection */
+    pid_t             pid;          /*< One-shot script (0 if FastCGI) */
+    struct fcgi_pool *pool;         /*< Pool of FastCGI connection */
+    bool              transient;    /*< Pool started for this request alone */
+    bool              reused;       /*< Connection was idle in the pool before */
+    bool              wait;         /*< Wait for a connection when all are busy */
+    bool              started;      /*< Worker has answered */
+    char            **envp;         /*< Request parameters (to retry request) */
+    size_t            remaining;    /*< Bytes left in current FCGI_STDOUT record */
+    size_t            padding;      /*< Padding after current record */
+    bool              done;         /*< FCGI_END_REQUEST received */
+};
+
+/* Signals the server ignores or handles itself (and ignored dispositions
+ * survive exec), which scripts must start out with the defaults for */
+static const int ScriptSignals[] = { SIGPIPE, SIGCHLD, SIGHUP, SIGTERM };
+
+/**
+ * Fill set with ScriptSignals.
+ **/
+static void
+cgi_signals(sigset_t *set)
+{
+    sigemptyset(set);
+    for (size_t i = 0; i < sizeof(ScriptSignals) / sizeof(ScriptSignals[0]); i++)
+        sigaddset(set, ScriptSignals[i]);
+}
+
+/**
+ * Start FastCGI worker on listening socket lfd.
+ *
+ * Workers are forked rather than spawned so that they can ask to be
+ * terminated along with the thread that started them (PR_SET_PDEATHSIG);
+ * otherwise they would outlive the server.  As the FastCGI spec requires,
+ * the worker accepts connections on its standard input.
+ **/
+static pid_t
+fcgi_spawn(const char *path, int lfd)
+{
+    char  env_path[BUFSIZ];
+    char *argv[] = { (char *)path, NULL };
+    char *envp[] = { env_path, NULL };
+    pid_t parent = getpid();
+    pid_t pid;
+    sigset_t mask;
+
+    snprintf(env_path, sizeof(env_path), "PATH=%s", getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Unable to fork FastCGI worker: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        for (size_t i = 0; i < sizeof(ScriptSignals) / sizeof(ScriptSignals[0]); i++)
+            signal(ScriptSignals[i], SIG_DFL);
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        /* The parent may have exited before the death signal was armed */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            _exit(EXIT_FAILURE);
+        if (dup2(lfd, STDIN_FILENO) < 0)
+            _exit(EXIT_FAILURE);
+        execve(path, argv, envp);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Respawn workers that have exited (must hold Pools.lock).
+ **/
+static void
+fcgi_pool_reap(struct fcgi_pool *pool)
+{
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        if (pool->pids[i] > 0 && waitpid(pool->pids[i], NULL, WNOHANG) == 0)
+            continue;
+        debug("Starting FastCGI worker for %s", pool->path);
+        pool->pids[i] = fcgi_spawn(pool->path, pool->lfd);
+    }
+}
+
+/**
+ * Terminate pool's workers and free the pool.
+ **/
+static void
+fcgi_pool_stop(struct fcgi_pool *pool)
+{
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        if (pool->pids[i] > 0) {
+            kill(pool->pids[i], SIGTERM);
+            while (waitpid(pool->pids[i], NULL, 0) < 0 && errno == EINTR);
+        }
+    }
+    for (size_t i = 0; i < pool->nidle; i++)
+        close(pool->idle[i]);
+    if (pool->lfd >= 0)
+        close(pool->lfd);
+
+    pthread_cond_destroy(&pool->available);
+    free(pool->path);
+    free(pool->pids);
+    free(pool->idle);
+    free(pool);
+}
+
+/**
+ * Start pool of nworkers workers for script (must hold Pools.lock).
+ *
+ * Workers listen on a socket in the abstract namespace, so nothing is left
+ * in the filesystem.  Returns NULL on error.
+ **/
+static struct fcgi_pool *
+fcgi_pool_start(const char *path, size_t nworkers)
+{
+    struct fcgi_pool *pool;
+
+    if ((pool = calloc(1, sizeof(struct fcgi_pool))) == NULL)
+        return NULL;
+    pool->lfd = -1;
+
+    if ((pool->path = strdup(path)) == NULL ||
+        (pool->pids = calloc(nworkers, sizeof(pid_t))) == NULL ||
+        (pool->idle = calloc(nworkers, sizeof(int))) == NULL) {
+        fprintf(stderr, "Unable to allocate FastCGI pool: %s\n", strerror(errno));
+        goto fail;
+    }
+    pool->nworkers = nworkers;
+
+    pool->addr.sun_family = AF_UNIX;
+    pool->addrlen = offsetof(struct sockaddr_un, sun_path) + 1 +
+        snprintf(pool->addr.sun_path + 1, sizeof(pool->addr.sun_path) - 1, "spidey-fastcgi-%d-%lu", getpid(), Pools.count++);
+
+    if ((pool->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(pool->lfd, (struct sockaddr *)&pool->addr, pool->addrlen) < 0 ||
+        listen(pool->lfd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Unable to listen for FastCGI workers: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    pthread_cond_init(&pool->available, NULL);
+    fcgi_pool_reap(pool);
+    return pool;
+
+fail:
+    if (pool->lfd >= 0)
+        close(pool->lfd);
+    free(pool->path);
+    free(pool->pids);
+    free(pool->idle);
+    free(pool);
+    return NULL;
+}
+
+/**
+ * Take connection to one of pool's workers (must hold Pools.lock).
+ *
+ * Each worker serves one connection at a time, so there are never more
+ * connections than workers: requests beyond that wait for one to be
+ * released if wait is set, and otherwise fail with errno set to EBUSY (an
+ * event loop cannot wait, since it may be the thread that would release
+ * one).  Sets reused if the connection was idle in the pool.  Returns -1 on
+ * error.
+ **/
+static int
+fcgi_acquire(struct fcgi_pool *pool, bool *reused, bool wait)
+{
+    struct timeval timeout = { .tv_sec = FCGI_TIMEOUT };
+    int fd;
+
+    while (pool->nidle == 0 && pool->connections >= pool->nworkers) {
+        if (!wait) {
+            errno = EBUSY;
+            return -1;
+        }
+        pthread_cond_wait(&pool->available, &Pools.lock);
+    }
+
+    if ((*reused = pool->nidle > 0))
+        return pool->idle[--pool->nidle];
+
+    /* Open new connection (to a live worker) */
+    fcgi_pool_reap(pool);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(fd, (struct sockaddr *)&pool->addr, pool->addrlen) < 0) {
+        fprintf(stderr, "Unable to connect to FastCGI worker for %s: %s\n", pool->path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    pool->connections++;
+    return fd;
+}
+
+/**
+ * Return connection to pool: kept for the next request if reusable,
+ * otherwise closed.
+ **/
+static void
+fcgi_release(struct fcgi_pool *pool, int fd, bool reusable)
+{
+    pthread_mutex_lock(&Pools.lock);
+    if (reusable) {
+        pool->idle[pool->nidle++] = fd;
+    } else {
+        close(fd);
+        pool->connections--;
+        fcgi_pool_reap(pool);
+    }
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&Pools.lock);
+}
+
+/**
+ * Write FastCGI record header at p and return pointer past it.
+ **/
+static char *
+fcgi_header(char *p, unsigned char type, size_t length)
+{
+    p[0] = FCGI_VERSION_1;
+    p[1] = type;
+    p[2] = 0;
+    p[3] = FCGI_REQUEST_ID;
+    p[4] = (length >> 8) & 0xff;
+    p[5] = length & 0xff;
+    p[6] = 0;   /* Padding */
+    p[7] = 0;
+    return p + FCGI_HEADER_SIZE;
+}
+
+/**
+ * Write FastCGI name-value pair length at p and return pointer past it.
+ **/
+static char *
+fcgi_length(char *p, size_t length)
+{
+    if (length < 128) {
+        *p++ = length;
+    } else {
+        *p++ = ((length >> 24) & 0x7f) | 0x80;
+        *p++ = (length >> 16) & 0xff;
+        *p++ = (length >> 8) & 0xff;
+        *p++ = length & 0xff;
+    }
+    return p;
+}
+
+/**
+ * Send request to worker: FCGI_BEGIN_REQUEST, the environment as
+ * FCGI_PARAMS, and an empty FCGI_STDIN, all in one write.
+ **/
+static bool
+fcgi_send(int fd, char **envp)
+{
+    size_t  nparams = 0;
+    size_t  length;
+    char   *params, *message, *p, *q;
+    ssize_t nwritten;
+    bool    sent = false;
+
+    /* Encode name-value pairs */
+    for (char **e = envp; *e; e++)
+        nparams += 8 + strlen(*e);
+    if ((params = malloc(nparams)) == NULL)
+        return false;
+
+    p = params;
+    for (char **e = envp; *e; e++) {
+        char *equals = strchr(*e, '=');
+        if (equals == NULL)
+            continue;
+        p = fcgi_length(p, equals - *e);
+        p = fcgi_length(p, strlen(equals + 1));
+        memcpy(p, *e, equals - *e);
+        p += equals - *e;
+        memcpy(p, equals + 1, strlen(equals + 1));
+        p += strlen(equals + 1);
+    }
+    nparams = p - params;
+
+    /* Frame them in records */
+    length = 2 * FCGI_HEADER_SIZE + (nparams / FCGI_RECORD_MAX + 1) * FCGI_HEADER_SIZE + nparams + 2 * FCGI_HEADER_SIZE;
+    if ((message = malloc(length)) == NULL)
+        goto done;
+
+    p = fcgi_header(message, FCGI_BEGIN_REQUEST, 8);
+    memset(p, 0, 8);
+    p[1] = FCGI_RESPONDER;
+    p[2] = FCGI_KEEP_CONN;
+    p += 8;
+
+    for (q = params; q < params + nparams; q += FCGI_RECORD_MAX) {
+        size_t n = params + nparams - q < FCGI_RECORD_MAX ? (size_t)(params + nparams - q) : FCGI_RECORD_MAX;
+        p = fcgi_header(p, FCGI_PARAMS, n);
+        memcpy(p, q, n);
+        p += n;
+    }
+    p = fcgi_header(p, FCGI_PARAMS, 0);
+    p = fcgi_header(p, FCGI_STDIN, 0);
+
+    for (q = message; q < p; q += nwritten) {
+        if ((nwritten = write(fd, q, p - q)) < 0) {
+            if (errno == EINTR) {
+                nwritten = 0;
+                continue;
+            }
+            fprintf(stderr, "Unable to write to FastCGI worker: %s\n", strerror(errno));
+            goto done;
+        }
+    }
+    sent = true;
+
+done:
+    free(message);
+    free(params);
+    return sent;
+}
+
+/**
+ * Read exactly length bytes from fd into buffer (or discard them if buffer
+ * is NULL).
+ **/
+static bool
+fcgi_read(int fd, char *buffer, size_t length)
+{
+    char    discard[BUFSIZ];
+    ssize_t nread;
+
+    while (length > 0) {
+        nread = read(fd, buffer ? buffer : discard, buffer || length < sizeof(discard) ? length : sizeof(discard));
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return false;
+        if (buffer)
+            buffer += nread;
+        length -= nread;
+    }
+    return true;
+}
+
+/**
+ * Retry request on a new connection after its idle connection turned out to
+ * be dead (its worker exited meanwhile).
+ **/
+static bool
+fcgi_retry(struct cgi *s)
+{
+    fcgi_release(s->pool, s->fd, false);
+
+    pthread_mutex_lock(&Pools.lock);
+    s->fd = fcgi_acquire(s->pool, &s->reused, s->wait);
+    pthread_mutex_unlock(&Pools.lock);
+
+    if (s->fd < 0)
+        return false;
+    s->padding = 0;
+    return fcgi_send(s->fd, s->envp);
+}
+
+/**
+ * Read up to size bytes of script output: straight from the pipe for CGI,
+ * or from the FCGI_STDOUT records of a FastCGI worker (FCGI_STDERR is
+ * relayed to the server's stderr).
+ *
+ * Returns the number of bytes read, 0 at the end of the output, or -1 on
+ * error.
+ **/
+ssize_t
+cgi_read(struct cgi *s, char *buffer, size_t size)
+{
+    unsigned char header[FCGI_HEADER_SIZE];
+    char    message[BUFSIZ];
+    size_t  length;
+    ssize_t nread;
+
+    if (s->pool == NULL) {
+        while ((nread = read(s->fd, buffer, size)) < 0 && errno == EINTR);
+        return nread;
+    }
+
+    while (s->remaining == 0) {
+        if (s->done)
+            return 0;
+        if (!fcgi_read(s->fd, NULL, s->padding) || !fcgi_read(s->fd, (char *)header, sizeof(header))) {
+            if (s->reused && !s->started && fcgi_retry(s))
+                continue;
+            return -1;
+        }
+        s->started = true;
+
+        length     = (header[4] << 8) | header[5];
+        s->padding = header[6];
+        switch (header[1]) {
+            case FCGI_STDOUT:
+                s->remaining = length;
+                break;
+            case FCGI_STDERR:
+                for (size_t n; length > 0; length -= n) {
+                    n = length < sizeof(message) ? length : sizeof(message);
+                    if (!fcgi_read(s->fd, message, n))
+                        return -1;
+                    fwrite(message, 1, n, stderr);
+                }
+                break;
+            case FCGI_END_REQUEST:
+                s->done = fcgi_read(s->fd, NULL, length + s->padding);
+                s->padding = 0;
+                return s->done ? 0 : -1;
+            default:
+                if (!fcgi_read(s->fd, NULL, length))
+                    return -1;
+                break;
+        }
+    }
+
+    while ((nread = read(s->fd, buffer, size < s->remaining ? size : s->remaining)) < 0 && errno == EINTR);
+    if (nread <= 0)
+        return -1;
+    s->remaining -= nread;
+    return nread;
+}
+
+/**
+ * Return the pipe a one-shot script writes its output to (so that it can
+ * be spliced), or -1 for FastCGI.
+ **/
+int
+cgi_pipe(struct cgi *s)
+{
+    return s->pool == NULL ? s->fd : -1;
+}
+
+/**
+ * Finish with script: reap a one-shot script, and return a FastCGI
+ * connection to its pool (kept only if the whole response was read).
+ **/
+void
+cgi_close(struct cgi *s)
+{
+
+    if (s->pool == NULL) {
+        close(s->fd);
+        while (waitpid(s->pid, NULL, 0) < 0 && errno == EINTR);
+    } else if (s->transient) {
+        close(s->fd);
+        fcgi_pool_stop(s->pool);
+    } else if (s->fd >= 0) {
+        fcgi_release(s->pool, s->fd, s->done && s->padding == 0);
+    }
+
+    free(s);
+}
+
+/**
+ * Allocate copy of script state.
+ **/
+static struct cgi *
+cgi_new(struct cgi init)
+{
+    struct cgi *s;
+
+    if ((s = malloc(sizeof(struct cgi))) != NULL)
+        *s = init;
+    return s;
+}
+
+/**
+ * Run one-shot CGI script with posix_spawn (no shell), with envp as its
+ * whole environment, default ScriptSignals and no signals blocked.
+ **/
+static struct cgi *
+cgi_spawn(const char *path, char **envp)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, mask;
+    char *argv[] = { (char *)path, NULL };
+    int   fds[2];
+    int   status;
+    pid_t pid;
+    struct cgi *s;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        fprintf(stderr, "Unable to create pipe: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    cgi_signals(&defaults);
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    status = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+
+    if (status != 0) {
+        fprintf(stderr, "Unable to spawn %s: %s\n", path, strerror(status));
+        close(fds[0]);
+        return NULL;
+    }
+
+    if ((s = cgi_new((struct cgi){ .fd = fds[0], .pid = pid })) == NULL) {
+        close(fds[0]);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    return s;
+}
+
+/**
+ * Run request on FastCGI worker for script.
+ *
+ * Each script has a pool of FastCGIWorkers persistent workers, started on
+ * its first request, with a persistent connection to each: concurrent
+ * requests are spread across the connections, and once all are busy either
+ * wait for one to be free or (unless wait is set) fail with errno set to
+ * EBUSY.  If FastCGIWorkers is 0, a worker is started for this request
+ * alone.
+ **/
+static struct cgi *
+fcgi_open(const char *path, char **envp, bool wait)
+{
+    struct fcgi_pool *pool;
+    struct cgi  s = { .fd = -1, .transient = FastCGIWorkers == 0, .wait = wait, .envp = envp };
+    struct cgi *running;
+    int         error;
+
+    pthread_mutex_lock(&Pools.lock);
+    if (s.transient) {
+        pool = fcgi_pool_start(path, 1);
+    } else {
+        for (pool = Pools.head; pool && !streq(pool->path, path); pool = pool->next);
+        if (pool == NULL && (pool = fcgi_pool_start(path, FastCGIWorkers)) != NULL) {
+            pool->next = Pools.head;
+            Pools.head = pool;
+        }
+    }
+    if ((s.pool = pool) != NULL)
+        s.fd = fcgi_acquire(pool, &s.reused, wait);
+    error = errno;
+    pthread_mutex_unlock(&Pools.lock);
+
+    if (s.fd < 0) {
+        errno = error;
+        goto fail;
+    }
+
+    if ((fcgi_send(s.fd, envp) || (s.reused && fcgi_retry(&s))) && (running = cgi_new(s)) != NULL)
+        return running;
+
+    if (!s.transient) {
+        if (s.fd >= 0)
+            fcgi_release(pool, s.fd, false);
+        return NULL;
+    }
+    close(s.fd);
+
+fail:
+    if (s.transient && pool)
+        fcgi_pool_stop(pool);
+    return NULL;
+}
+
+/**
+ * Run CGI script at path with environment envp.  Returns the running script,
+ * whose output is read with cgi_read and which must be finished with
+ * cgi_close, or NULL on error.
+ *
+ * Scripts named *.fcgi are FastCGI applications and run in persistent
+ * worker pools; any other script is spawned for this request alone.  If all
+ * of a pool's workers are busy, this waits for one if wait is set, and
+ * otherwise returns NULL with errno set to EBUSY.
+ **/
+struct cgi *
+cgi_open(const char *path, char **envp, bool wait)
+{
+    size_t length = strlen(path);
+
+    if (length > 5 && streq(path + length - 5, ".fcgi"))
+        return fcgi_open(path, envp, wait);
+    return cgi_spawn(path, envp);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,269 @@
+/* compress.c: Response Compression */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define COMPRESS_MIN            256     /* Bodies smaller than this are sent as is */
+#define COMPRESS_LEVEL          9       /* For bodies compressed once and cached */
+#define COMPRESS_STREAM_LEVEL   6       /* For bodies compressed on every request */
+#define COMPRESS_GZIP           (15 + 16)   /* zlib window bits for a gzip wrapper */
+#define COMPRESS_BUFFER_SIZE    (64*1024)
+
+/* Compressible Types: prefixes ending in '/', otherwise whole types */
+
+static const char *CompressibleTypes[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/x-javascript",
+    "application/xml",
+    "image/svg+xml",
+    NULL,
+};
+
+/* Streaming Compressor */
+
+struct compressor {
+    z_stream z;
+    bool     chunked;                       /*< Send output as HTTP chunks */
+    bool     queued;                        /*< Output buffer is queued to be sent */
+    char     output[COMPRESS_BUFFER_SIZE];  /*< Compressed data not yet sent */
+};
+
+/**
+ * Determine whether client accepts gzip content coding (RFC 7231 5.3.4):
+ * it must be listed, or covered by "*", with a non-zero q value.
+ **/
+bool
+compress_accepted(struct request *r)
+{
+    double gzip = -1, any = -1;
+
+    for (size_t i = 0; i < r->nheaders; i++) {
+        const char *p = r->headers[i].value;
+
+        if (r->headers[i].id != HEADER_ACCEPT_ENCODING)
+            continue;
+
+        while (*p) {
+            size_t      length;
+            double      q = 1;
+            const char *parameters;
+
+            p     += strspn(p, " \t,");
+            length = strcspn(p, " \t,;");
+            parameters = p + length;
+            while (*parameters == ' ' || *parameters == '\t' || *parameters == ';') {
+                parameters += strspn(parameters, " \t;");
+                if (strncasecmp(parameters, "q=", 2) == 0)
+                    q = strtod(parameters + 2, NULL);
+                parameters += strcspn(parameters, ",;");
+            }
+
+            if ((length == 4 && strncasecmp(p, "gzip", 4) == 0) || (length == 6 && strncasecmp(p, "x-gzip", 6) == 0))
+                gzip = q;
+            else if (length == 1 && *p == '*')
+                any = q;
+            p = parameters;
+        }
+    }
+
+    return gzip >= 0 ? gzip > 0 : any > 0;
+}
+
+/**
+ * Determine whether a body of mimetype and length (negative if not known in
+ * advance) is worth compressing: it must be text-like and not tiny.  Types
+ * that are already compressed (images, audio, video, archives) are not.
+ **/
+bool
+compress_worthy(const char *mimetype, off_t length)
+{
+    size_t n = strcspn(mimetype, " ;");
+
+    if (length >= 0 && length < COMPRESS_MIN)
+        return false;
+
+    if (n > 4 && (strncasecmp(mimetype + n - 4, "+xml", 4) == 0 || (n > 5 && strncasecmp(mimetype + n - 5, "+json", 5) == 0)))
+        return true;
+
+    for (const char **type = CompressibleTypes; *type; type++) {
+        size_t m = strlen(*type);
+        if ((*type)[m - 1] == '/' ? strncasecmp(mimetype, *type, m) == 0 : (n == m && strncasecmp(mimetype, *type, m) == 0))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Open precompressed sibling of file at path (path + ".gz"), provided it is
+ * a regular file no older than the file itself (modified at mtime).
+ *
+ * Returns its descriptor and stores its fstat in s, or returns -1.
+ **/
+int
+compress_sibling(const char *path, const struct timespec *mtime, struct stat *s)
+{
+    char sibling[BUFSIZ];
+    int  fd;
+
+    if (snprintf(sibling, sizeof(sibling), "%s.gz", path) >= (int)sizeof(sibling))
+        return -1;
+    if ((fd = open(sibling, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    if (fstat(fd, s) < 0 || !S_ISREG(s->st_mode) ||
+        s->st_mtim.tv_sec < mtime->tv_sec ||
+        (s->st_mtim.tv_sec == mtime->tv_sec && s->st_mtim.tv_nsec < mtime->tv_nsec)) {
+        debug("Ignoring stale or irregular %s", sibling);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Compress data with gzip in one go.
+ *
+ * Returns the compressed data (to be freed by the caller) and stores its
+ * length in compressed, or returns NULL on error.
+ **/
+char *
+compress_buffer(const char *data, size_t length, size_t *compressed)
+{
+    z_stream z = { 0 };
+    char    *output;
+    size_t   size;
+
+    if (deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_GZIP, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    size = deflateBound(&z, length);
+    if ((output = malloc(size)) == NULL) {
+        deflateEnd(&z);
+        return NULL;
+    }
+
+    z.next_in   = (Bytef *)data;
+    z.avail_in  = length;
+    z.next_out  = (Bytef *)output;
+    z.avail_out = size;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&z);
+        free(output);
+        return NULL;
+    }
+
+    *compressed = z.total_out;
+    deflateEnd(&z);
+    return output;
+}
+
+/**
+ * Start compressing a response body as it is produced (sent as HTTP chunks
+ * if chunked).  Returns NULL on error.
+ **/
+struct compressor *
+compress_open(bool chunked)
+{
+    struct compressor *c;
+
+    if ((c = calloc(1, sizeof(struct compressor))) == NULL)
+        return NULL;
+
+    if (deflateInit2(&c->z, COMPRESS_STREAM_LEVEL, Z_DEFLATED, COMPRESS_GZIP, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(c);
+        return NULL;
+    }
+    c->chunked     = chunked;
+    c->z.next_out  = (Bytef *)c->output;
+    c->z.avail_out = sizeof(c->output);
+    return c;
+}
+
+/**
+ * Run deflate with flush mode over pending input, queueing the output once
+ * the output buffer fills up (or whatever there is, unless flush is
+ * Z_NO_FLUSH).  Output queued by the previous call must have been sent by
+ * now, as the output buffer is reused.
+ *
+ * Returns 1 once the input is consumed (or, for Z_FINISH, the stream is
+ * complete), 0 if a full buffer was queued and more output is waiting, or -1
+ * on error.
+ **/
+static int
+compress_deflate(struct compressor *c, struct request *r, int flush)
+{
+    bool full;
+
+    if (c->queued) {
+        c->z.next_out  = (Bytef *)c->output;
+        c->z.avail_out = sizeof(c->output);
+        c->queued      = false;
+    }
+
+    if (deflate(&c->z, flush) == Z_STREAM_ERROR)
+        return -1;
+
+    full = c->z.avail_out == 0;
+    if (full || (flush != Z_NO_FLUSH && c->z.avail_out < sizeof(c->output))) {
+        if (!response_chunk(r, c->output, sizeof(c->output) - c->z.avail_out, c->chunked))
+            return -1;
+        c->queued = true;
+    }
+    return full ? 0 : 1;
+}
+
+/**
+ * Compress more of the body (a piece of it as produced by a body producer,
+ * see response_produce).  If flush is set, everything compressed so far is
+ * queued now (for output that should reach the client as it is produced);
+ * otherwise output is queued in large pieces.
+ *
+ * Returns as compress_deflate: while it returns 0, data must stay valid,
+ * and the rest is compressed by calling again with NULL data (and the same
+ * flush) once the queued output has been sent.
+ **/
+int
+compress_write(struct compressor *c, struct request *r, const char *data, size_t length, bool flush)
+{
+    if (data != NULL) {
+        c->z.next_in  = (Bytef *)data;
+        c->z.avail_in = length;
+    }
+    return compress_deflate(c, r, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+}
+
+/**
+ * Finish compressed body, queueing the rest of it.  Returns as
+ * compress_deflate: while it returns 0, call again once the queued output
+ * has been sent.
+ **/
+int
+compress_finish(struct compressor *c, struct request *r)
+{
+    c->z.avail_in = 0;
+    return compress_deflate(c, r, Z_FINISH);
+}
+
+/**
+ * Free the compressor (whether or not the body was finished).
+ **/
+void
+compress_close(struct compressor *c)
+{
+    deflateEnd(&c->z);
+    free(c);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
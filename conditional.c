@@ -0,0 +1,186 @@
+/* conditional.c: Conditional and Range Requests */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define HTTP_DATE_FORMAT    "%a, %d %b %Y %H:%M:%S GMT"
+
+/**
+ * Compute validators of a file from its inode number, size and mtime: a
+ * strong ETag (with a separate one for its gzip variant) and Last-Modified.
+ **/
+void
+conditional_init(struct validators *v, ino_t ino, off_t size, const struct timespec *mtime)
+{
+    unsigned long long version = mtime->tv_sec * 1000000000ULL + mtime->tv_nsec;
+    struct tm tm;
+
+    snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx-%llx\"",
+             (unsigned long long)ino, (unsigned long long)size, version);
+    snprintf(v->gzip_etag, sizeof(v->gzip_etag), "\"%llx-%llx-%llx-gz\"",
+             (unsigned long long)ino, (unsigned long long)size, version);
+
+    v->mtime = mtime->tv_sec;
+    gmtime_r(&v->mtime, &tm);
+    strftime(v->modified, sizeof(v->modified), HTTP_DATE_FORMAT, &tm);
+}
+
+/**
+ * Write ETag (of the gzip variant if gzip) and Last-Modified headers.
+ **/
+void
+conditional_headers(struct request *r, const struct validators *v, bool gzip)
+{
+    response_puts(r, "ETag: ");
+    response_puts(r, gzip ? v->gzip_etag : v->etag);
+    response_puts(r, "\r\nLast-Modified: ");
+    response_puts(r, v->modified);
+    response_puts(r, "\r\n");
+}
+
+/**
+ * Parse HTTP date (IMF-fixdate).  Returns -1 if it is not one.
+ **/
+static time_t
+conditional_date(const char *s)
+{
+    struct tm   tm = { 0 };
+    const char *end = strptime(s, HTTP_DATE_FORMAT, &tm);
+
+    return end && *skip_whitespace((char *)end) == '\0' ? timegm(&tm) : -1;
+}
+
+/**
+ * Determine whether comma-separated list of entity tags contains etag,
+ * comparing weakly (ignoring any W/ prefix), or is "*".
+ **/
+static bool
+conditional_match(const char *list, const char *etag)
+{
+    size_t length = strlen(etag);
+
+    while (*list) {
+        size_t n;
+
+        list += strspn(list, " \t,");
+        if (*list == '*')
+            return true;
+        if (strncmp(list, "W/", 2) == 0)
+            list += 2;
+        n = strcspn(list, " \t,");
+        if (n == length && strncmp(list, etag, length) == 0)
+            return true;
+        list += n;
+    }
+    return false;
+}
+
+/**
+ * Determine whether client's copy is still fresh, so a 304 Not Modified
+ * response will do: If-None-Match lists the ETag of the variant being sent
+ * (the gzip one if gzip), or, only if there is no If-None-Match,
+ * If-Modified-Since is no older than Last-Modified.  Only for GET and HEAD.
+ **/
+bool
+conditional_fresh(struct request *r, const struct validators *v, bool gzip)
+{
+    const char *none_match = request_header(r, HEADER_IF_NONE_MATCH);
+    const char *modified_since;
+    time_t      since;
+
+    if (!streq(r->method, "GET") && !streq(r->method, "HEAD"))
+        return false;
+
+    if (none_match)
+        return conditional_match(none_match, gzip ? v->gzip_etag : v->etag);
+
+    if ((modified_since = request_header(r, HEADER_IF_MODIFIED_SINCE)) == NULL ||
+        (since = conditional_date(modified_since)) < 0)
+        return false;
+    return v->mtime <= since;
+}
+
+/**
+ * Parse Range header of a GET request for a body of size bytes into at most
+ * max ranges (in request order).
+ *
+ * The header is ignored, so the whole body is sent, if it is malformed,
+ * lists more than max ranges, or has an If-Range that does not match the
+ * (strong) ETag or Last-Modified.
+ *
+ * Returns the number of satisfiable ranges, 0 if the whole body should be
+ * sent, or -1 if none of the ranges can be satisfied.
+ **/
+int
+conditional_ranges(struct request *r, const struct validators *v, off_t size, struct range *ranges, size_t max)
+{
+    const char *range  = request_header(r, HEADER_RANGE);
+    const char *if_range = request_header(r, HEADER_IF_RANGE);
+    const char *p;
+    size_t      n = 0, listed = 0;
+
+    if (range == NULL || !streq(r->method, "GET"))
+        return 0;
+
+    if (if_range) {
+        if (*if_range == '"' ? !streq(if_range, v->etag) : conditional_date(if_range) != v->mtime)
+            return 0;
+    }
+
+    if (strncasecmp(range, "bytes=", 6) != 0)
+        return 0;
+
+    for (p = range + 6; *p; ) {
+        unsigned long long first, last;
+        char *end;
+
+        p += strspn(p, " \t,");
+        if (*p == '\0')
+            break;
+        if (++listed > max)
+            return 0;
+
+        if (*p == '-') {
+            /* Suffix range: the last so many bytes (none is unsatisfiable) */
+            last = strtoull(p + 1, &end, 10);
+            if (end == p + 1)
+                return 0;
+            first = last == 0 ? (unsigned long long)size : last < (unsigned long long)size ? size - last : 0;
+            last  = size - 1;
+        } else {
+            first = strtoull(p, &end, 10);
+            if (end == p || *end != '-')
+                return 0;
+            p = end + 1;
+            last = strtoull(p, &end, 10);
+            if (end == p)
+                last = size - 1;
+            else if (last < first)
+                return 0;
+            else if (last >= (unsigned long long)size)
+                last = size - 1;
+        }
+
+        p = end + strspn(end, " \t");
+        if (*p != ',' && *p != '\0')
+            return 0;
+
+        if (first < (unsigned long long)size) {
+            ranges[n].first  = first;
+            ranges[n].length = last - first + 1;
+            n++;
+        }
+    }
+
+    if (listed == 0)
+        return 0;
+    return n > 0 ? (int)n : -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
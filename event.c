@@ -0,0 +1,294 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_MAX	256
+
+/* Event Loop */
+
+struct event_loop {
+    int                 efd;    /*< epoll file descriptor */
+    int                 sfd;    /*< Server socket */
+    struct timer_wheel  timers; /*< Connection deadlines */
+};
+
+/**
+ * Schedule connection to expire when it has gone SendTimeout seconds without
+ * taking any of a pending response, or else at the deadline of the request
+ * being received (timer wheels count seconds of metrics_now).
+ **/
+static void
+event_schedule(struct event_loop *loop, struct request *r)
+{
+    time_t expires = 0;
+
+    if (response_pending(r))
+        expires = SendTimeout ? metrics_now() / 1000000000ULL + SendTimeout : 0;
+    else if (r->deadline)
+        expires = (r->deadline + 999999999ULL) / 1000000000ULL;
+
+    if (expires)
+        timer_schedule(&loop->timers, r, expires);
+    else
+        timer_cancel(&loop->timers, r);
+}
+
+/**
+ * Remove connection from the event loop and free it (logging a request
+ * whose body was cut off).
+ **/
+static void
+event_close(struct event_loop *loop, struct request *r)
+{
+    if (response_streaming(r))
+        handle_finish(r, false);
+    timer_cancel(&loop->timers, r);
+    epoll_ctl(loop->efd, EPOLL_CTL_DEL, r->fd, NULL);
+    free_request(r);
+}
+
+/**
+ * Watch connection for output space (while a response is waiting to be sent)
+ * as well as input.
+ **/
+static int
+event_watch_output(struct event_loop *loop, struct request *r, bool enabled)
+{
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP | EPOLLET | (enabled ? EPOLLOUT : 0),
+        .data.ptr = r,
+    };
+
+    return epoll_ctl(loop->efd, EPOLL_CTL_MOD, r->fd, &event);
+}
+
+/**
+ * Register client request with the event loop.
+ *
+ * The client socket is switched to non-blocking mode for good and watched
+ * for input in edge-triggered mode, with the request itself as the event's
+ * data.
+ **/
+static int
+event_add_request(struct event_loop *loop, struct request *r)
+{
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP | EPOLLET,
+        .data.ptr = r,
+    };
+
+    if (socket_nonblocking(r->fd, true) < 0)
+        return -1;
+    r->nonblocking = true;
+
+    if (epoll_ctl(loop->efd, EPOLL_CTL_ADD, r->fd, &event) < 0) {
+        fprintf(stderr, "Unable to add client to epoll: %s\n", strerror(errno));
+        return -1;
+    }
+
+    event_schedule(loop, r);
+    return 0;
+}
+
+/**
+ * Accept every pending client on the (non-blocking) server socket.
+ **/
+static void
+event_accept(struct event_loop *loop)
+{
+    struct request *request;
+
+    while ((request = accept_request(loop->sfd)) != NULL) {
+        if (event_add_request(loop, request) < 0) {
+            free_request(request);
+        }
+    }
+}
+
+/**
+ * Send as much of the pending response as the socket takes, producing more
+ * of a body as it goes, and finish the request once a body (or file) being
+ * streamed is done.
+ *
+ * Returns true if everything was sent and the connection can go on to its
+ * next request.  Otherwise the connection is left watching for output space
+ * (already if waiting), or closed (once everything was sent, if closing).
+ **/
+static bool
+event_send(struct event_loop *loop, struct request *r, bool waiting)
+{
+    bool streaming = response_streaming(r);
+
+    switch (response_flush(r)) {
+        case 0:     /* Send the rest once the socket drains */
+            if (!waiting && event_watch_output(loop, r, true) < 0)
+                break;
+            event_schedule(loop, r);
+            return false;
+        case 1:     /* Response sent */
+            if (streaming)
+                handle_finish(r, true);
+            if (r->closing)
+                break;
+            if (streaming)
+                reset_request(r);
+            if (waiting && event_watch_output(loop, r, false) < 0)
+                break;
+            return true;
+        default:
+            if (streaming)
+                handle_finish(r, false);
+            break;
+    }
+    event_close(loop, r);
+    return false;
+}
+
+/**
+ * Make progress on a client connection that has input (or output space)
+ * available.
+ *
+ * Once read_request reports a complete (or malformed) request, it is handed
+ * to handle_request, which queues the response without ever waiting for the
+ * socket: files and long bodies are left to be sent (or produced) by
+ * response_flush as the client takes them, and the request is only finished
+ * (and the connection reset, or closed) once they are done.  Since bytes of
+ * the next request may already be in the receive buffer, parsing then
+ * resumes immediately rather than waiting for the next event, and responses
+ * are only sent once no further pipelined request is buffered (or the
+ * response buffer is filling up).
+ *
+ * If the client does not take the whole response at once, the rest is sent
+ * as the socket drains, and no further request is read meanwhile.
+ **/
+static void
+event_read(struct event_loop *loop, struct request *r)
+{
+    /* Finish sending earlier responses (and producing their bodies) first */
+    if (response_pending(r) && !event_send(loop, r, true))
+        return;
+
+    while (true) {
+        switch (read_request(r)) {
+            case 0:     /* Waiting for more input (send what is batched meanwhile) */
+                if (response_pending(r) && !event_send(loop, r, false))
+                    return;
+                event_schedule(loop, r);
+                return;
+            case 1:     /* Request complete */
+                handle_request(r);
+                r->closing = !r->keep_alive;
+                if (response_streaming(r) || r->closing) {
+                    if (!event_send(loop, r, false))
+                        return;
+                    continue;
+                }
+                reset_request(r);
+
+                /* Batch responses to pipelined requests into one write, but
+                 * send them while there is still room for the next response
+                 * (up to two segments per range), so that handlers never
+                 * have to wait for the socket */
+                if (!request_pending(r) || r->used > sizeof(r->output) / 2 ||
+                    r->niov > RESPONSE_IOV_MAX - 2 * (RANGE_MAX + 1)) {
+                    if (!event_send(loop, r, false))
+                        return;
+                }
+                break;
+            default:    /* Client closed connection or error */
+                event_close(loop, r);
+                return;
+        }
+    }
+}
+
+/**
+ * Close connections whose deadline has passed.
+ *
+ * Clients that stopped part way through a request are told so with a 408
+ * Request Timeout (if the socket takes it at once); idle connections and
+ * clients that stopped reading responses are simply closed (see
+ * event_close).
+ **/
+static void
+event_expire(struct event_loop *loop)
+{
+    time_t now = metrics_now() / 1000000000ULL;
+    struct request *r;
+
+    while ((r = timer_expired(&loop->timers, now)) != NULL) {
+        debug("Closing expired connection from %s:%s", r->host, r->port);
+        if (r->started && !response_pending(r) && (r->state == PARSE_METHOD || r->state == PARSE_HEADERS)) {
+            r->state = PARSE_TIMEOUT;
+            handle_request(r);
+        }
+        event_close(loop, r);
+    }
+}
+
+/**
+ * Handle HTTP requests with a single-threaded epoll event loop.
+ *
+ * Requests are parsed incrementally as input arrives, so slow or idle
+ * clients only occupy their request struct rather than the server, and only
+ * until their deadline passes (see event_expire).  Client sockets stay
+ * non-blocking throughout: responses are sent, and long bodies produced, as
+ * the client takes them (handlers and body producers still wait for local
+ * files and scripts, but never for a client).
+ **/
+void
+event_server(int sfd)
+{
+    struct epoll_event events[EVENT_MAX];
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLET,
+        .data.ptr = NULL,
+    };
+    struct event_loop loop = { .sfd = sfd };
+    int n;
+
+    timer_init(&loop.timers);
+
+    /* Create event loop and watch the server socket */
+    if ((loop.efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fatal("Unable to create epoll: %s", strerror(errno));
+    }
+
+    if (socket_nonblocking(sfd, true) < 0 || epoll_ctl(loop.efd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        fatal("Unable to watch server socket: %s", strerror(errno));
+    }
+
+    /* Dispatch events, checking for expired connections every second */
+    while (true) {
+        n = epoll_wait(loop.efd, events, EVENT_MAX, loop.timers.count ? 1000 : -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                event_accept(&loop);
+            else
+                event_read(&loop, events[i].data.ptr);
+        }
+
+        event_expire(&loop);
+    }
+
+    /* Close event loop and server socket */
+    close(loop.efd);
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
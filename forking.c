@@ -1,45 +1,100 @@
 /* forking.c: Forking HTTP Server */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
+/**
+ * SIGCHLD handler: nothing to do but interrupt ppoll.
+ **/
+static void
+forking_child(int signum)
+{
+}
+
+/**
+ * Reap exited children, releasing the connections of those that did not
+ * exit normally (only handle_connection's end exits with EXIT_SUCCESS,
+ * once free_request has released its connection).
+ **/
+static void
+forking_reap(void)
+{
+    pid_t pid;
+    int   status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        limits_reap(pid, WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Children release their connections from the connection limits when they
+ * are done, and the parent releases those of children that crash or are
+ * killed when it reaps them.  SIGCHLD is only unblocked while waiting for a
+ * client, so children that have exited are reaped before the next
+ * connection is admitted.
  **/
 void
 forking_server(int sfd)
 {
+    struct sigaction action = { .sa_handler = forking_child, .sa_flags = SA_NOCLDSTOP };
+    struct pollfd pfd = { .fd = sfd, .events = POLLIN };
     struct request *request;
+    sigset_t mask, unblocked;
     pid_t pid;
 
+    /* Wake up whenever a child exits */
+    sigaction(SIGCHLD, &action, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &unblocked);
+
     /* Accept and handle HTTP request */
     while (true) {
+        forking_reap();
+        if (ppoll(&pfd, 1, NULL, &unblocked) < 0)
+            continue;
+
     	/* Accept request */
         request = accept_request(sfd);
         if (request == NULL) {
             continue;
         }
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
+
+        /* Reload MIME types before the child inherits them */
+        mime_refresh();
+
 	/* Fork off child process to handle request */
-        pid_t pid = fork();
+        pid = fork();
         if (pid < 0){
-            fprintf(stderr, "Unable to fork: %s\n", strerror(errno))
+            fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+            free_request(request);
         }
         else if (pid == 0){
+            signal(SIGCHLD, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &unblocked, NULL);
             close(sfd);
-            handle_request(request);
+            PathCacheSize = 0;  /* Child lives too briefly to watch RootPath */
+            FastCGIWorkers = 0; /* ... or to keep FastCGI workers */
+            handle_connection(request);
+            free_request(request);
             exit(EXIT_SUCCESS);
         }
         else {
+            limits_hand_off(request, pid);
             free_request(request);
         }
     }   
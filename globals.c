@@ -0,0 +1,33 @@
+/* globals.c: Global Variables (shared by spidey and spidey-bench) */
+
+#include "spidey.h"
+
+/* Global Variables */
+char *Port	      = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+size_t WorkerThreads  = 8;
+size_t ReactorShards  = 0;
+char *ReactorCPUs     = NULL;
+size_t PreforkMin     = 4;
+size_t PreforkMax     = 64;
+unsigned long PreforkRequests = 10000;
+unsigned int KeepAliveTimeout = 5;
+unsigned long KeepAliveRequests = 100;
+unsigned int HeaderTimeout = 10;
+unsigned int BodyTimeout   = 30;
+unsigned int SendTimeout   = 30;
+size_t RequestHeaderMax    = 32*1024;
+unsigned int MaxConnections       = 1024;
+unsigned int MaxClientConnections = 256;
+size_t CacheBytes     = 16*1024*1024;
+unsigned int CacheRevalidate = 1;
+size_t PathCacheSize  = 1024;
+bool ResolveHostnames = false;
+size_t FastCGIWorkers = 2;
+char *MetricsURI      = "/metrics";
+char *AccessLogPath   = "-";
+bool AccessLogBlock   = false;
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,25 +1,79 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define RELAY_BUFFER_SIZE	(64*1024)   /* Script output or file data read at a time */
+#define LISTING_PAGE_SIZE	1000        /* Directory entries listed per page */
+#define LISTING_BUFFER_SIZE	(64*1024)   /* Listing page rendered (and sent) at a time */
+
 /* Internal Declarations */
 http_status handle_browse_request(struct request *request);
 http_status handle_file_request(struct request *request);
+http_status handle_cached_request(struct request *request, struct cache_entry *entry);
+http_status handle_compressed_request(struct request *request, int fd, const char *mimetype, const struct validators *v);
+http_status handle_not_modified(struct request *request, const struct validators *v, bool gzip, bool vary);
+http_status handle_range_request(struct request *request, const struct validators *v, const char *mimetype, off_t size,
+                                 const struct range *ranges, int n, int fd, struct cache_entry *entry);
 http_status handle_cgi_request(struct request *request);
+http_status handle_metrics_request(struct request *request);
 http_status handle_error(struct request *request, http_status status);
+bool        write_headers(struct request *request, const char *status, const char *type, off_t length);
+
+/**
+ * Handle HTTP Connection
+ *
+ * This handles requests on the client connection until the client (or the
+ * server) decides to close it: either side asks for Connection: close, the
+ * client is idle for longer than KeepAliveTimeout, or KeepAliveRequests
+ * requests have been handled.
+ *
+ * Responses are only flushed to the socket once no further pipelined request
+ * is waiting in the receive buffer (or when the connection is closed).
+ *
+ * Returns the number of requests handled.
+ **/
+size_t
+handle_connection(struct request *r)
+{
+    size_t handled = 0;
+
+    while (true) {
+        handle_request(r);
+        handled += (r->state != PARSE_CLOSED);
+        if (!r->keep_alive)
+            break;
+        reset_request(r);
+
+        /* Batch responses to pipelined requests into one write */
+        if (!request_pending(r) && !response_drain(r))
+            break;
+    }
+    return handled;
+}
 
 /**
  * Handle HTTP Request
  *
  * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * type, and then dispatches to the appropriate handler type.  Files (and
+ * directory listings) in the file cache are served straight from it, and
+ * MetricsURI is answered with the server's metrics whatever RootPath holds.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
@@ -27,14 +81,28 @@ http_status
 handle_request(struct request *r)
 {
     http_status result;
+    struct cache_entry *entry;
+    unsigned long long now;
 
     /* Parse request */
     int rstatus = parse_request(r);
     if (rstatus == 0){
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
-    request_type rtype = determine_request_type(r->path);     
+    now = metrics_record(METRICS_PARSE, r->started);
+    if (*MetricsURI && streq(r->uri, MetricsURI)) {
+        result = handle_metrics_request(r);
+        goto done;
+    }
+    /* Determine request path and type */
+    request_type rtype;
+    r->path = resolve_request_path(&r->arena, r->uri, &rtype);
+    bool too_long = !r->path && errno == ENAMETOOLONG;
     debug("HTTP REQUEST PATH: %s", r->path);
+    now = metrics_record(METRICS_RESOLVE, now);
+    if ((rtype == REQUEST_FILE || rtype == REQUEST_BROWSE) && (entry = cache_lookup(r->path)) != NULL) {
+        result = handle_cached_request(r, entry);
+        metrics_record(METRICS_HANDLER + rtype, now);
+        goto done;
+    }
     /* Dispatch to appropriate request handler type */
     if(rtype == REQUEST_BROWSE)
         result = handle_browse_request(r);    
@@ -42,59 +110,231 @@ handle_request(struct request *r)
         result = handle_cgi_request(r);
     else if(rtype == REQUEST_FILE)
         result = handle_file_request(r);
+    else
+        result = too_long ? HTTP_STATUS_URI_TOO_LONG : HTTP_STATUS_NOT_FOUND;
+    metrics_record(METRICS_HANDLER + rtype, now);
+    }
+    else if (r->state == PARSE_TIMEOUT)
+        result = HTTP_STATUS_REQUEST_TIMEOUT;
+    else if (r->state == PARSE_TOO_LARGE)
+        result = r->method ? HTTP_STATUS_HEADER_FIELDS_TOO_LARGE : HTTP_STATUS_URI_TOO_LONG;
+    else
+        result = HTTP_STATUS_BAD_REQUEST;
+
+done:
+    if (r->state == PARSE_CLOSED) {
+        r->keep_alive = false;      /* No request to respond to */
+        return result;
+    }
+
+    if (result != HTTP_STATUS_OK && !r->responded)
+        handle_error(r, result);
+    else if (result == HTTP_STATUS_INTERNAL_SERVER_ERROR)
+        r->keep_alive = false;      /* Response already under way: just close */
+    r->status = result;
 
+    /* Bodies still to be produced (or files to be sent) are finished by the
+     * event loop on non-blocking sockets, and right here otherwise */
+    if (!response_streaming(r))
+        handle_finish(r, true);
+    else if (!r->nonblocking)
+        handle_finish(r, response_drain(r));
+    return r->status;
+}
+
+/**
+ * Finish request once its response is complete: log and count it.
+ *
+ * If the body could not be produced (or sent) in full, the request is
+ * logged as a 500 and the connection is closed, since the client cannot
+ * tell where the body ends.
+ **/
+void
+handle_finish(struct request *r, bool produced)
+{
+    if (!produced) {
+        r->status     = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        r->keep_alive = false;
     }
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
-    return result;
+    accesslog_request(r, r->status);
+    metrics_status(r->status);
+    metrics_record(METRICS_REQUEST, r->started);
 }
 
+/* Listing pages: rendered a buffer at a time as the client takes them */
+
+struct browse {
+    struct listing *listing;    /*< Directory listed */
+    size_t          page;       /*< Page listed (from 1) */
+    size_t          pages;      /*< Number of pages */
+    size_t          next;       /*< Next entry to render */
+    size_t          last;       /*< Entry after the last of the page */
+    bool            chunked;    /*< Send page as chunks */
+    bool            started;    /*< Page header rendered */
+    bool            ended;      /*< Page footer rendered */
+    char            buffer[LISTING_BUFFER_SIZE];
+    char            base[];     /*< URI of directory, without a trailing slash */
+};
+
+/**
+ * Render next piece of page into browse->buffer: the page header (with
+ * links to the previous and next pages of a large listing) first, then as
+ * many entries as fit, and finally the footer.  Returns its length, or 0 if
+ * an entry does not fit in the buffer at all.
+ **/
+static size_t
+handle_browse_render(struct browse *b)
+{
+    static const char footer[] = "</ul>\n</html>\n";
+    char  *buffer = b->buffer;
+    size_t size   = sizeof(b->buffer);
+    size_t length = 0;
+
+    if (!b->started) {
+        length += snprintf(buffer + length, size - length, "<html>\n");
+        if (b->pages > 1) {
+            length += snprintf(buffer + length, size - length, "<p>Page %zu of %zu", b->page, b->pages);
+            if (b->page > 1)
+                length += snprintf(buffer + length, size - length, " <a href=\"?page=%zu\">previous</a>", b->page - 1);
+            if (b->page < b->pages)
+                length += snprintf(buffer + length, size - length, " <a href=\"?page=%zu\">next</a>", b->page + 1);
+            length += snprintf(buffer + length, size - length, "</p>\n");
+        }
+        length += snprintf(buffer + length, size - length, "<ul>\n");
+        b->started = true;
+    }
+
+    length += listing_render(buffer + length, size - length, b->listing, &b->next, b->last, b->base);
+    if (b->next == b->last && size - length >= sizeof(footer) - 1) {
+        memcpy(buffer + length, footer, sizeof(footer) - 1);
+        length  += sizeof(footer) - 1;
+        b->ended = true;
+    }
+    return length;
+}
+
+/**
+ * Relay next piece of page (see response_produce).
+ **/
+static int
+handle_browse(struct request *r, void *state)
+{
+    struct browse *b = state;
+    size_t length;
+
+    if (b->ended) {
+        if (b->chunked && !response_puts(r, "0\r\n\r\n"))
+            return -1;
+        return 1;
+    }
+
+    if ((length = handle_browse_render(b)) == 0)
+        return -1;
+    return response_chunk(r, b->buffer, length, b->chunked) ? 0 : -1;
+}
+
+/**
+ * Finish with page: release its listing.
+ **/
+static void
+handle_browse_close(void *state)
+{
+    struct browse *b = state;
+
+    listing_close(b->listing);
+    free(b);
+}
+
+static const struct response_body BrowseBody = {
+    .produce = handle_browse,
+    .close   = handle_browse_close,
+};
+
 /**
  * Handle browse request
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML, sorted by name.
+ *
+ * The sorted names come from the listing cache, so a directory is only read
+ * and sorted again once it changes (see listing_open).  Listings of up to
+ * LISTING_PAGE_SIZE entries are rendered whole, once, into the file cache
+ * (if it is enabled), where they stay until the directory changes.  Larger
+ * directories are split into pages of LISTING_PAGE_SIZE entries (selected
+ * with ?page=N), and each page is rendered LISTING_BUFFER_SIZE bytes at a
+ * time as the client takes it, and sent with chunked transfer encoding.
  *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
  **/
 http_status handle_browse_request(struct request *r) {
-    struct dirent **entries;
-    int n;
-    char link[BUFSIZ];
-    struct header *header;
-    char *host;
-    /* Open a directory for reading or scanning */
-    n = scandir(r->path, &entries, NULL, alphasort);
-    if (n == -1) {;
+    struct listing *listing;
+    struct browse *b;
+    struct stat s;
+    struct cache_entry *entry;
+    const char *base = r->path + strlen(RootPath);
+    const char *query;
+    char *body = NULL;
+    size_t length = 0, n;
+    size_t page = 1, pages;
+    bool ended;
+    FILE *fs;
+
+    /* Look up directory (after its stat, so changes meanwhile are noticed) */
+    if (stat(r->path, &s) < 0 || (listing = listing_open(r->path, &s)) == NULL)
         return HTTP_STATUS_NOT_FOUND;
+    if (streq(base, "/"))
+        base = "";
+
+    /* Select page of a large listing */
+    pages = listing->count ? (listing->count + LISTING_PAGE_SIZE - 1) / LISTING_PAGE_SIZE : 1;
+    for (query = r->query; pages > 1 && query && *query; query += strcspn(query, "&"), query += *query == '&') {
+        if (strncmp(query, "page=", 5) == 0)
+            page = strtoul(query + 5, NULL, 10);
     }
-    
-    header = r->headers;
-    while (header != NULL){
-        if (streq(header->name, "Host")){
-            host = header->value;
-        }
-        header = header->next;
+    if (page < 1 || page > pages) {
+        listing_close(listing);
+        return HTTP_STATUS_NOT_FOUND;
     }
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n Content-Type: text/html\r\n\r\n");
 
-    /* For each entry in directory, emit HTML list item */
-    fprintf(r->file, "<html>\n");
-    fprintf(r->file, "<ul>\n");
-    while (n--) {
-        if(!streq(r->uri, "/"))
-            sprintf(link, "%s%s/%s", host, r->uri, entries[n]->d_name);
-        else
-            sprintf(link, "%s%s%s", host, r->uri, entries[n]->d_name);
-    fprintf(r->file, "<li><a href=\"http://%s\"> %s</a></li>\n", link ,entries[n]->d_name);
-        free(entries[n]);
+    if ((b = calloc(1, sizeof(struct browse) + strlen(base) + 1)) == NULL) {
+        listing_close(listing);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    b->listing = listing;
+    b->page    = page;
+    b->pages   = pages;
+    b->next    = (page - 1) * LISTING_PAGE_SIZE;
+    b->last    = page * LISTING_PAGE_SIZE < listing->count ? page * LISTING_PAGE_SIZE : listing->count;
+    strcpy(b->base, base);
+
+    /* Stream pages of large listings (and any listing without a cache) */
+    if (pages > 1 || CacheBytes == 0) {
+        b->chunked = write_headers(r, http_status_string(HTTP_STATUS_OK), "text/html", -1);
+        response_write(r, "\r\n", 2);
+        response_produce(r, &BrowseBody, b);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Render small listing whole and cache it */
+    if ((fs = open_memstream(&body, &length)) == NULL) {
+        handle_browse_close(b);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    while (!b->ended && (n = handle_browse_render(b)) > 0)
+        fwrite(b->buffer, 1, n, fs);
+    ended = b->ended;
+    handle_browse_close(b);
+    if (fclose(fs) != 0 || !ended) {
+        free(body);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
-    fprintf(r->file, "</ul>\n");
-    fprintf(r->file, "</html>\n");
-    free(entries);
 
-    /* Flush socket, return OK */
-    fflush(r->file);
+    if ((entry = cache_store(r->path, &s, "text/html", body, length)) != NULL)
+        return handle_cached_request(r, entry);
+
+    write_headers(r, http_status_string(HTTP_STATUS_OK), "text/html", length);
+    response_write(r, "\r\n", 2);
+    response_adopt(r, body, length);
     return HTTP_STATUS_OK;
 }
 
@@ -102,131 +342,705 @@ http_status handle_browse_request(struct request *r) {
  *  * Handle file request
  *   *
  *    * This opens and streams the contents of the specified file to the socket.
+ *    * Files small enough for the file cache are added to it and served from
+ *    * there.  Otherwise, the body is sent with sendfile once the headers are,
+ *    * so it never passes through user space (see response_flush).
+ *    *
+ *    * Text files are sent compressed to clients that accept gzip: from the
+ *    * file's precompressed .gz sibling if there is a fresh one, otherwise
+ *    * compressed on the fly.
  *     *
  *      * If the path cannot be opened for reading, then handle error with
  *       * HTTP_STATUS_NOT_FOUND.
  *        **/
 http_status handle_file_request(struct request *r){
-    FILE *fs;
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    int fd;
+    const char *mimetype = NULL;
+    struct stat s, gz;
+    struct cache_entry *entry;
+    struct validators v;
+    struct range ranges[RANGE_MAX];
+    int nranges;
+    int gzfd;
+    bool vary, gzip;
 
     /* Open file for reading */
-    fs = fopen(r->path, "r");//switch it to R
-    if (fs == NULL){
+    fd = open(r->path, O_RDONLY);
+    if (fd < 0){
+        return HTTP_STATUS_NOT_FOUND;
+    }
+    if (fstat(fd, &s) < 0) {
+        close(fd);
         return HTTP_STATUS_NOT_FOUND;
     }
 
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
+    mimetype = determine_mimetype(&r->arena, r->path);
+
+    /* Serve small files from the file cache */
+    if ((entry = cache_insert(r->path, fd, &s, mimetype)) != NULL) {
+        close(fd);
+        return handle_cached_request(r, entry);
+    }
+
+    /* Answer conditional and range requests (ranges are never compressed) */
+    conditional_init(&v, s.st_ino, s.st_size, &s.st_mtim);
+    nranges = conditional_ranges(r, &v, s.st_size, ranges, RANGE_MAX);
+    vary = compress_worthy(mimetype, s.st_size);
+    gzip = vary && nranges == 0 && compress_accepted(r);
+    if (conditional_fresh(r, &v, gzip)) {
+        close(fd);
+        return handle_not_modified(r, &v, gzip, vary);
+    }
+    if (nranges != 0)
+        return handle_range_request(r, &v, mimetype, s.st_size, ranges, nranges, fd, NULL);
+
+    /* Compress text for clients that accept it */
+    if (gzip) {
+        if ((gzfd = compress_sibling(r->path, &s.st_mtim, &gz)) < 0)
+            return handle_compressed_request(r, fd, mimetype, &v);
+        close(fd);
+        fd = gzfd;
+        s  = gz;
+    }
 
     /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n Content-Type: %s\r\n\r\n", mimetype);
-    /* Read from file and write to socket in chunks */
-    size_t members;
-    while((members = fread(buffer, 1, BUFSIZ, fs)) > 0 ){
-        if(members != fwrite(buffer, 1, members, r->file)){
-            fclose(fs); 
-            free(mimetype);
-            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    write_headers(r, http_status_string(HTTP_STATUS_OK), mimetype, s.st_size);
+    conditional_headers(r, &v, gzip);
+    response_puts(r, gzip ? "Content-Encoding: gzip\r\n" : "");
+    response_puts(r, vary ? "Vary: Accept-Encoding\r\n\r\n" : "\r\n");
+
+    /* Send file directly from the page cache to the socket (which closes it) */
+    if (!response_sendfile(r, fd, 0, s.st_size, true))
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle request for a file in the file cache
+ *
+ * The precomputed headers and the body are added to the response without
+ * being copied, so the whole response goes out in a single writev.  Clients
+ * that accept gzip get the entry's gzip variant instead, if it has one.
+ * Conditional and range requests are answered from the entry as well.  The
+ * entry is released once sent.
+ **/
+http_status
+handle_cached_request(struct request *r, struct cache_entry *entry)
+{
+    struct range ranges[RANGE_MAX];
+    int  nranges = conditional_ranges(r, &entry->validators, entry->length, ranges, RANGE_MAX);
+    bool gzip = entry->compressible && nranges == 0 && compress_accepted(r) && cache_compress(entry);
+
+    if (conditional_fresh(r, &entry->validators, gzip)) {
+        cache_release(entry);
+        return handle_not_modified(r, &entry->validators, gzip, entry->compressible);
+    }
+    if (nranges != 0)
+        return handle_range_request(r, &entry->validators, entry->mimetype, entry->length, ranges, nranges, -1, entry);
+
+    r->responded = true;
+    if (gzip)
+        response_reference(r, entry->gzip_headers, entry->gzip_hlength, NULL);
+    else
+        response_reference(r, entry->headers, entry->hlength, NULL);
+    response_puts(r, r->keep_alive ? "keep-alive\r\n\r\n" : "close\r\n\r\n");
+    if (gzip)
+        response_reference(r, entry->gzip, entry->gzip_length, entry);
+    else
+        response_reference(r, entry->body, entry->length, entry);
+    return HTTP_STATUS_OK;
+}
+
+/* Relays: bodies copied from a script or file as the client takes them */
+
+struct relay {
+    struct cgi        *cgi;         /*< Script body comes from (or NULL) */
+    int                fd;          /*< File body comes from (if no script) */
+    struct compressor *compressor;  /*< Compresses body (or NULL) */
+    bool               chunked;     /*< Send body as chunks */
+    bool               flush;       /*< Send compressed output as it is produced */
+    bool               deflating;   /*< Compressor has more output waiting */
+    bool               ended;       /*< Input has ended */
+    long long          remaining;   /*< Bytes of body left to relay (-1 = until input ends) */
+    char              *data;        /*< Input not yet relayed (in buffer) */
+    size_t             length;      /*< Bytes at data */
+    char               buffer[RELAY_BUFFER_SIZE];
+};
+
+/**
+ * Relay next piece of body (see response_produce).
+ *
+ * Input is read a buffer at a time, then queued as it is (spliced straight
+ * from a script's pipe when its length is known and it is sent as is), or
+ * compressed.  The buffer is only reused once everything queued from it has
+ * been sent, at the next call.
+ **/
+static int
+handle_relay(struct request *r, void *state)
+{
+    struct relay *relay = state;
+    size_t  size = sizeof(relay->buffer);
+    ssize_t nread;
+    int     status;
+
+    /* Let compressor queue the rest of its output for earlier input */
+    if (relay->deflating) {
+        if (relay->ended)
+            status = compress_finish(relay->compressor, r);
+        else
+            status = compress_write(relay->compressor, r, NULL, 0, relay->flush);
+        relay->deflating = status == 0;
+        return status < 0 ? -1 : 0;
+    }
+
+    /* End body once input (and compression) is done */
+    if (relay->ended) {
+        if (relay->chunked && !response_puts(r, "0\r\n\r\n"))
+            return -1;
+        return 1;
+    }
+
+    /* Read more input (after any read along with the CGI headers) */
+    if (relay->length == 0) {
+        if (relay->remaining == 0) {
+            relay->ended = true;
+            return 0;
         }
-    }   
+        if (relay->remaining > 0 && relay->compressor == NULL && relay->cgi && cgi_pipe(relay->cgi) >= 0) {
+            if (!response_sendfile(r, cgi_pipe(relay->cgi), 0, relay->remaining, false))
+                return -1;
+            relay->remaining = 0;
+            return 0;
+        }
+
+        if (relay->remaining > 0 && (unsigned long long)relay->remaining < size)
+            size = relay->remaining;
+        if (relay->cgi)
+            nread = cgi_read(relay->cgi, relay->buffer, size);
+        else
+            nread = read(relay->fd, relay->buffer, size);
+        if (nread < 0)
+            return -1;
+        if (nread == 0) {
+            if (relay->remaining > 0) {
+                debug("CGI script %s ended before its Content-Length", r->path);
+                return -1;
+            }
+            relay->ended     = true;
+            relay->deflating = relay->compressor != NULL;
+            return 0;
+        }
+        relay->data   = relay->buffer;
+        relay->length = nread;
+    }
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs); 
-    fflush(r->file);
-    free(mimetype);
+    /* Queue input (ignoring any beyond the Content-Length) */
+    if (relay->remaining >= 0) {
+        if ((unsigned long long)relay->remaining < relay->length)
+            relay->length = relay->remaining;
+        relay->remaining -= relay->length;
+    }
+    if (relay->compressor) {
+        status = compress_write(relay->compressor, r, relay->data, relay->length, relay->flush);
+        relay->deflating = status == 0;
+    } else {
+        status = response_chunk(r, relay->data, relay->length, relay->chunked) ? 1 : -1;
+    }
+    relay->length = 0;
+    return status < 0 ? -1 : 0;
+}
+
+/**
+ * Finish with relay: free compressor, finish script (or close file).
+ **/
+static void
+handle_relay_close(void *state)
+{
+    struct relay *relay = state;
+
+    if (relay->compressor)
+        compress_close(relay->compressor);
+    if (relay->cgi)
+        cgi_close(relay->cgi);
+    else if (relay->fd >= 0)
+        close(relay->fd);
+    free(relay);
+}
+
+static const struct response_body RelayBody = {
+    .produce = handle_relay,
+    .close   = handle_relay_close,
+};
+
+/**
+ * Start relay from script cgi, or (if NULL) the file open at fd, taking
+ * over either.  Returns NULL on error (after closing them).
+ **/
+static struct relay *
+handle_relay_open(struct cgi *cgi, int fd)
+{
+    struct relay *relay;
+
+    if ((relay = calloc(1, sizeof(struct relay))) == NULL) {
+        if (cgi)
+            cgi_close(cgi);
+        else
+            close(fd);
+        return NULL;
+    }
+    relay->cgi       = cgi;
+    relay->fd        = fd;
+    relay->remaining = -1;
+    return relay;
+}
+
+/**
+ * Handle request for a file compressed as it is sent
+ *
+ * This relays the file open at fd (which it takes over) in large blocks,
+ * compressed with gzip, chunked (or terminated by closing the connection
+ * for HTTP/1.0 clients) since the compressed length is not known in
+ * advance.
+ **/
+http_status
+handle_compressed_request(struct request *r, int fd, const char *mimetype, const struct validators *v)
+{
+    struct relay *relay;
+
+    if ((relay = handle_relay_open(NULL, fd)) == NULL)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    if ((relay->compressor = compress_open(r->version > 0)) == NULL) {
+        handle_relay_close(relay);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    relay->chunked = write_headers(r, http_status_string(HTTP_STATUS_OK), mimetype, -1);
+    conditional_headers(r, v, true);
+    response_puts(r, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n");
+    response_produce(r, &RelayBody, relay);
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Handle conditional request for a file the client already has
+ *
+ * This writes a 304 Not Modified response: the validators of the variant
+ * the client would otherwise get, and no body.
+ **/
+http_status
+handle_not_modified(struct request *r, const struct validators *v, bool gzip, bool vary)
+{
+    r->responded = true;
+    response_puts(r, "HTTP/1.1 ");
+    response_puts(r, http_status_string(HTTP_STATUS_NOT_MODIFIED));
+    response_puts(r, "\r\n");
+    conditional_headers(r, v, gzip);
+    if (vary)
+        response_puts(r, "Vary: Accept-Encoding\r\n");
+    response_puts(r, r->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    return HTTP_STATUS_NOT_MODIFIED;
+}
+
+/**
+ * Format the header of one part of a multipart/byteranges body (starting
+ * with the delimiter line).  Returns its length, as snprintf does.
+ **/
+static int
+handle_range_part(char *buffer, size_t size, const char *boundary, const char *mimetype, const struct range *range, off_t total)
+{
+    return snprintf(buffer, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    boundary, mimetype, (long long)range->first, (long long)(range->first + range->length - 1), (long long)total);
+}
+
+/**
+ * Handle range request for a file
+ *
+ * This writes a 206 Partial Content response with the n ranges parsed by
+ * conditional_ranges: a single range as the body itself, several as a
+ * multipart/byteranges body.  If none of the ranges is satisfiable (n < 0),
+ * it writes a 416 Range Not Satisfiable response instead.
+ *
+ * The body is sliced out of the cache entry if there is one, and otherwise
+ * sent from the file open at fd with sendfile.  Either way, the response
+ * takes over the entry (or fd) and releases it once sent.
+ **/
+http_status
+handle_range_request(struct request *r, const struct validators *v, const char *mimetype, off_t size,
+                     const struct range *ranges, int n, int fd, struct cache_entry *entry)
+{
+    const char *unsatisfiable = http_status_string(HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+    char boundary[64];
+    char part[BUFSIZ];
+    char type[BUFSIZ];
+    char content_range[BUFSIZ];
+    off_t length = 0;
+    struct timespec now;
+
+    if (n < 0) {
+        if (entry)
+            cache_release(entry);
+        if (fd >= 0)
+            close(fd);
+        write_headers(r, unsatisfiable, "text/html", strlen(unsatisfiable));
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%lld\r\n\r\n", (long long)size);
+        response_puts(r, content_range);
+        response_puts(r, unsatisfiable);
+        return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+
+    if (n == 1) {
+        length = ranges[0].length;
+        snprintf(type, sizeof(type), "%s", mimetype);
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 (long long)ranges[0].first, (long long)(ranges[0].first + ranges[0].length - 1), (long long)size);
+    } else {
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(boundary, sizeof(boundary), "spidey%08lx%08lx", (unsigned long)now.tv_nsec, (unsigned long)getpid());
+        snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s", boundary);
+        content_range[0] = '\0';
+        for (int i = 0; i < n; i++)
+            length += handle_range_part(NULL, 0, boundary, mimetype, &ranges[i], size) + ranges[i].length;
+        length += strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
+    }
+
+    write_headers(r, http_status_string(HTTP_STATUS_PARTIAL_CONTENT), type, length);
+    conditional_headers(r, v, false);
+    response_puts(r, content_range);
+    response_puts(r, "\r\n");
+
+    for (int i = 0; i < n; i++) {
+        if (n > 1) {
+            handle_range_part(part, sizeof(part), boundary, mimetype, &ranges[i], size);
+            response_puts(r, part);
+        }
+
+        if (entry) {
+            /* The last slice takes over the reference to the entry */
+            if (!response_reference(r, entry->body + ranges[i].first, ranges[i].length, i == n - 1 ? entry : NULL)) {
+                if (i < n - 1)
+                    cache_release(entry);
+                return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            }
+        } else if (!response_sendfile(r, fd, ranges[i].first, ranges[i].length, i == n - 1)) {
+            /* As does the last range with fd */
+            if (i < n - 1)
+                close(fd);
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (n > 1) {
+        response_puts(r, "\r\n--");
+        response_puts(r, boundary);
+        response_puts(r, "--\r\n");
+    }
+    return HTTP_STATUS_PARTIAL_CONTENT;
+}
+
+/**
+ * Determine whether two headers have the same name (ignoring case).
+ **/
+static bool
+header_same(const struct header *a, const struct header *b)
+{
+    return a->id == b->id && (a->id != HEADER_OTHER || strcasecmp(a->name, b->name) == 0);
+}
+
+/**
+ * Add NAME=value to CGI environment (allocated from request's arena).
+ **/
+static void
+handle_cgi_export(struct request *r, char **envp, size_t *n, const char *name, const char *value)
+{
+    size_t length = strlen(name) + strlen(value) + 2;
+    char  *variable = arena_alloc(&r->arena, length);
+
+    if (variable == NULL) {
+        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
+        return;
+    }
+    snprintf(variable, length, "%s=%s", name, value);
+    envp[(*n)++] = variable;
+}
+
+/**
+ * Build CGI environment for request (allocated from request's arena).
+ *
+ * Besides the request metadata and PATH, each header becomes HTTP_<NAME>
+ * (Content-Type and Content-Length become CONTENT_TYPE and CONTENT_LENGTH).
+ * Repeated headers are joined into one variable in the order they were
+ * sent.  The server's own environment is never modified.
+ *
+ * http://en.wikipedia.org/wiki/Common_Gateway_Interface
+ **/
+static char **
+handle_cgi_environment(struct request *r)
+{
+    char   name[BUFSIZ];
+    char   remote[NI_MAXHOST];
+    char  *value;
+    char **envp;
+    size_t length, n = 0;
+
+    if ((envp = arena_alloc(&r->arena, (12 + r->nheaders + 1) * sizeof(char *))) == NULL)
+        return NULL;
+
+    resolve_host(r->host, remote, sizeof(remote));
+    handle_cgi_export(r, envp, &n, "DOCUMENT_ROOT", RootPath);
+    handle_cgi_export(r, envp, &n, "PATH", getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    handle_cgi_export(r, envp, &n, "QUERY_STRING", r->query);
+    handle_cgi_export(r, envp, &n, "REMOTE_ADDR", r->host);
+    handle_cgi_export(r, envp, &n, "REMOTE_HOST", remote);
+    handle_cgi_export(r, envp, &n, "REMOTE_PORT", r->port);
+    handle_cgi_export(r, envp, &n, "REQUEST_METHOD", r->method);
+    handle_cgi_export(r, envp, &n, "REQUEST_URI", r->uri);
+    handle_cgi_export(r, envp, &n, "SCRIPT_FILENAME", r->path);
+    handle_cgi_export(r, envp, &n, "SERVER_PORT", Port);
+
+    for (size_t i = 0; i < r->nheaders; i++) {
+        struct header *header = &r->headers[i];
+        const char *separator = header->id == HEADER_COOKIE ? "; " : ", ";
+        bool repeated = false;
+
+        /* Export each name once, at its first occurrence */
+        for (size_t j = 0; j < i && !repeated; j++)
+            repeated = header_same(&r->headers[j], header);
+        if (repeated)
+            continue;
+
+        /* Join values of repeated headers */
+        length = strlen(header->value) + 1;
+        for (size_t j = i + 1; j < r->nheaders; j++) {
+            if (header_same(&r->headers[j], header))
+                length += strlen(separator) + strlen(r->headers[j].value);
+        }
+        if ((value = arena_alloc(&r->arena, length)) == NULL)
+            continue;
+        strcpy(value, header->value);
+        for (size_t j = i + 1; j < r->nheaders; j++) {
+            if (header_same(&r->headers[j], header)) {
+                strcat(value, separator);
+                strcat(value, r->headers[j].value);
+            }
+        }
+
+        /* Name variable */
+        if (header->id == HEADER_CONTENT_TYPE) {
+            snprintf(name, sizeof(name), "CONTENT_TYPE");
+        } else if (header->id == HEADER_CONTENT_LENGTH) {
+            snprintf(name, sizeof(name), "CONTENT_LENGTH");
+        } else {
+            snprintf(name, sizeof(name), "HTTP_%s", header->name);
+            for (char *c = name + 5; *c; c++)
+                *c = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '_';
+        }
+        handle_cgi_export(r, envp, &n, name, value);
+    }
+
+    envp[n] = NULL;
+    return envp;
+}
+
+/**
+ * Find end of CGI header block (the blank line) in script output, and
+ * return pointer to the body that follows it, or NULL if it has not been
+ * read yet.
+ **/
+static char *
+handle_cgi_body(char *buffer, size_t length)
+{
+    char *lf   = memmem(buffer, length, "\n\n", 2);
+    char *crlf = memmem(buffer, length, "\n\r\n", 3);
+
+    if (length >= 1 && buffer[0] == '\n')
+        return buffer + 1;
+    if (length >= 2 && buffer[0] == '\r' && buffer[1] == '\n')
+        return buffer + 2;
+    if (lf && (crlf == NULL || lf < crlf))
+        return lf + 2;
+    if (crlf)
+        return crlf + 3;
+    return NULL;
+}
+
+/**
+ * Append formatted header line to the size bytes of extra, nextra of which
+ * are used.  Returns false (leaving extra as it was) if it does not fit.
+ **/
+static bool
+handle_cgi_header(char *extra, size_t size, size_t *nextra, const char *format, ...)
+{
+    va_list args;
+    int     n;
+
+    va_start(args, format);
+    n = vsnprintf(extra + *nextra, size - *nextra, format, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= size - *nextra) {
+        extra[*nextra] = '\0';
+        return false;
+    }
+    *nextra += n;
+    return true;
+}
+
 /**
  *  * Handle CGI request
  *   *
- *    * This popens and streams the results of the specified executables to the
- *     * socket.
+ *    * This runs the specified executable (see cgi_open), parses the CGI
+ *    * header block it writes (Status, Content-Type, Content-Length,
+ *    * Location and any other headers to pass through) into the response
+ *    * headers, and then relays the body to the socket in large binary-safe
+ *    * chunks as the script produces it and the client takes it (see
+ *    * handle_relay).  If the script gives a Content-Length, the body is sent
+ *    * as is (spliced straight from its pipe when possible); otherwise it is
+ *    * sent with chunked transfer encoding.
+ *     *
  *      *
  *       *
- *        * If the path cannot be popened, then handle error with
- *         * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ *        * If the script cannot be run or writes a malformed header block (or
+ *        * more headers to pass through than fit in BUFSIZ bytes), then
+ *         * handle error with HTTP_STATUS_INTERNAL_SERVER_ERROR.  If every
+ *         * FastCGI worker of the script is busy and the request is served by
+ *         * an event loop (which must not wait for one), then handle error with
+ *         * HTTP_STATUS_SERVICE_UNAVAILABLE.
  *          **/
 http_status
 handle_cgi_request(struct request *r)
 {
-    FILE *pfs;
-    char buffer[BUFSIZ];
-    struct header *header;
-    int result;
-    
-    /* Export CGI environment variables from request:
- *     * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    result = setenv("DOCUMENT_ROOT", RootPath, 1);
-    
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("QUERY_STRING", r->query, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("REMOTE_ADDR", r->host, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("REMOTE_PORT", r->port, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("REQUEST_METHOD", r->method, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("REQUEST_URI", r->uri, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("SCRIPT_FILENAME", r->path, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
-    result = setenv("SERVER_PORT", Port, 1);
-    if (result < 0)
-        fprintf(stderr, "failed to set environmental variable: %s\n", strerror(errno));
- 
-    /* Export CGI environment variables from request headers */
-    header = r->headers;
-    while (header != NULL){
-        if (streq(header->name, "Accept")){
-            result = setenv("HTTP_ACCEPT", header->value, 1);
-        }
-        else if (streq(header->name,"Host")){
-            result = setenv("HTTP_HOST", header->value, 1);
+    struct cgi *cgi;
+    struct relay *relay;
+    char status[BUFSIZ] = "200 OK";
+    char type[BUFSIZ];
+    char extra[BUFSIZ] = "";
+    size_t nextra = 0;
+    size_t length = 0;
+    long long content_length = -1;
+    bool has_status = false;
+    bool has_location = false;
+    bool has_encoding = false;
+    char *body = NULL, *line, *eol, *value;
+    char **envp;
+    ssize_t nread;
 
-        }
-        else if (streq (header->name, "Accept-Language")){
-            result = setenv("HTTP_ACCEPT_LANGUAGE", header->value, 1);
+    snprintf(type, sizeof(type), "%s", DefaultMimeType);
 
-        }
-        else if (streq (header->name, "Accept-Encoding")){
-            result = setenv("HTTP_ACCEPT_ENCODING", header->value, 1);
+    /* Run script with environment built from request */
+    if ((envp = handle_cgi_environment(r)) == NULL)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    if ((cgi = cgi_open(r->path, envp, !r->nonblocking)) == NULL)
+        return errno == EBUSY ? HTTP_STATUS_SERVICE_UNAVAILABLE : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    if ((relay = handle_relay_open(cgi, -1)) == NULL)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
+    /* Read script output up to the end of its header block */
+    while (body == NULL) {
+        if (length == sizeof(relay->buffer) ||
+            (nread = cgi_read(cgi, relay->buffer + length, sizeof(relay->buffer) - length)) <= 0) {
+            debug("CGI script %s wrote no header block", r->path);
+            goto fail;
         }
-        else if (streq (header->name, "Connection")){
-            result = setenv("HTTP_CONNECTION", header->value, 1);
+        length += nread;
+        body = handle_cgi_body(relay->buffer, length);
+    }
 
+    /* Parse CGI headers: either an HTTP status line or a Status header,
+     * Content-Type, Content-Length, and any other headers to pass through */
+    for (line = relay->buffer; line < body; line = eol + 1) {
+        eol = memchr(line, '\n', body - line);
+        *eol = '\0';
+        if (eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+        if (*line == '\0')
+            break;
+
+        value = strchr(line, ':');
+        if (strncmp(line, "HTTP/", 5) == 0 && value == NULL) {
+            snprintf(status, sizeof(status), "%s", skip_whitespace(skip_nonwhitespace(line)));
+            has_status = true;
+            continue;
+        }
+        if (value == NULL) {
+            debug("CGI script %s wrote malformed header: %s", r->path, line);
+            goto fail;
         }
-        else if (streq (header->name, "User-Agent")){
-            result = setenv("HTTP_USER_AGENT", header->value, 1);
 
+        *value++ = '\0';
+        value = skip_whitespace(value);
+        if (strcasecmp(line, "Status") == 0) {
+            snprintf(status, sizeof(status), "%s", value);
+            has_status = true;
+        } else if (strcasecmp(line, "Content-Type") == 0) {
+            snprintf(type, sizeof(type), "%s", value);
+        } else if (strcasecmp(line, "Content-Length") == 0) {
+            content_length = strtoll(value, NULL, 10);
+        } else if (strcasecmp(line, "Connection") && strcasecmp(line, "Transfer-Encoding")) {
+            has_location |= strcasecmp(line, "Location") == 0;
+            has_encoding |= strcasecmp(line, "Content-Encoding") == 0;
+            if (!handle_cgi_header(extra, sizeof(extra), &nextra, "%s: %s\r\n", line, value)) {
+                debug("CGI script %s wrote too many headers", r->path);
+                goto fail;
+            }
         }
-        header = header->next;
     }
+    if (has_location && !has_status)
+        snprintf(status, sizeof(status), "302 Found");
 
-    /* POpen CGI Script */
-    if(!(pfs = popen(r->path, "r")))
-          return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    /* Compress text bodies of unknown length for clients that accept it */
+    if (content_length < 0 && !has_encoding && compress_worthy(type, -1)) {
+        if (compress_accepted(r) && (relay->compressor = compress_open(r->version > 0)) != NULL &&
+            !handle_cgi_header(extra, sizeof(extra), &nextra, "Content-Encoding: gzip\r\n"))
+            goto fail;
+        if (!handle_cgi_header(extra, sizeof(extra), &nextra, "Vary: Accept-Encoding\r\n"))
+            goto fail;
+    }
 
-    /* Copy data from popen to socket */
-    while(fgets(buffer, BUFSIZ, pfs) != NULL){
-        fputs(buffer, r->file);
-     }   
+    /* Write HTTP Headers */
+    relay->chunked = write_headers(r, status, type, content_length);
+    response_write(r, extra, nextra);
+    response_write(r, "\r\n", 2);
 
-    /* Close popen, flush socket, return OK */
-    pclose(pfs);
-    fflush(r->file);
+    /* Relay body: what was read with the headers first, then the rest
+     * (compressed output is flushed piece by piece, so that it still
+     * reaches the client as it is produced) */
+    relay->data      = body;
+    relay->length    = relay->buffer + length - body;
+    relay->remaining = content_length;
+    relay->flush     = true;
+    response_produce(r, &RelayBody, relay);
+    return HTTP_STATUS_OK;
+
+fail:
+    handle_relay_close(relay);
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+}
+
+/**
+ * Handle metrics request
+ *
+ * This renders the metrics of every process and thread of the server in the
+ * Prometheus text format.
+ **/
+http_status
+handle_metrics_request(struct request *r)
+{
+    char  *body = NULL;
+    size_t length = 0;
+    FILE  *fs;
+
+    if ((fs = open_memstream(&body, &length)) == NULL)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    metrics_render(fs);
+    if (fclose(fs) != 0) {
+        free(body);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    write_headers(r, http_status_string(HTTP_STATUS_OK), "text/plain; version=0.0.4", length);
+    response_puts(r, "Cache-Control: no-store\r\n\r\n");
+    response_adopt(r, body, length);
     return HTTP_STATUS_OK;
 }
 
@@ -242,14 +1056,48 @@ handle_error(struct request *r, http_status status)
     const char *status_string = http_status_string(status);
 
     /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    write_headers(r, status_string, "text/html", strlen(status_string));
+    response_write(r, "\r\n", 2);
     /* Write HTML Description of Error*/
-    fprintf(r->file, "%s", status_string);
+    response_puts(r, status_string);
     /* Return specified status */
     return status;
 }
 
+/**
+ * Write HTTP status line and the framing headers shared by every response:
+ * Content-Type, Content-Length (or Transfer-Encoding) and Connection.
+ *
+ * If length is negative, the body length is not known in advance: HTTP/1.1
+ * clients receive a chunked body, while HTTP/1.0 clients receive a body that
+ * is terminated by closing the connection.  The caller writes any additional
+ * headers, then the blank line that ends the headers.
+ *
+ * Returns whether the body must be sent with chunked transfer encoding.
+ **/
+bool
+write_headers(struct request *r, const char *status, const char *type, off_t length)
+{
+    bool chunked = length < 0 && r->version > 0;
+
+    if (length < 0 && !chunked)
+        r->keep_alive = false;
+    r->responded = true;
+
+    response_puts(r, "HTTP/1.1 ");
+    response_puts(r, status);
+    if (type != NULL) {
+        response_puts(r, "\r\nContent-Type: ");
+        response_puts(r, type);
+    }
+    if (chunked) {
+        response_puts(r, "\r\nTransfer-Encoding: chunked");
+    } else if (length >= 0) {
+        response_puts(r, "\r\nContent-Length: ");
+        response_number(r, length, 10);
+    }
+    response_puts(r, r->keep_alive ? "\r\nConnection: keep-alive\r\n" : "\r\nConnection: close\r\n");
+    return chunked;
+}
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
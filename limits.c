@@ -0,0 +1,210 @@
+/* limits.c: Connection Limits */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define LIMITS_CLIENT_SLOTS	4096    /* Per-client counters (clients may share one) */
+
+/* Limits: open connections are counted in shared memory, so the caps hold
+ * across forked children and prefork workers as well as threads.  Clients
+ * are counted in a fixed table indexed by a hash of their address, so the
+ * rare clients that share a counter also share their cap.
+ *
+ * A process that dies while holding a connection's counters would leak
+ * them for good, so the process that outlives it can release them too: the
+ * forking server keeps a note of each child's counters (see
+ * limits_hand_off) and releases them if the child does not exit normally,
+ * and prefork workers record theirs in the scoreboard (see limits_record),
+ * where the supervisor finds them when reaping. */
+
+struct limits {
+    unsigned int connections;                       /*< Open connections */
+    unsigned int clients[LIMITS_CLIENT_SLOTS];      /*< Open connections by client address hash */
+};
+
+static struct limits *Limits = NULL;
+static unsigned int  *Held   = NULL;    /* Where this process records its admission */
+
+/* Children of the forking server, with the counters they hold */
+
+struct limits_child {
+    pid_t        pid;
+    unsigned int admitted;
+};
+
+static struct limits_child *Children  = NULL;
+static size_t               NChildren = 0;
+static size_t               CChildren = 0;
+
+/**
+ * Map connection counters into memory shared with every process forked
+ * from now on.  Until this is called, connections are not limited.
+ * Returns false on error.
+ **/
+bool
+limits_init(void)
+{
+    if (MaxConnections == 0 && MaxClientConnections == 0)
+        return true;
+
+    Limits = mmap(NULL, sizeof(struct limits), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Limits == MAP_FAILED) {
+        fprintf(stderr, "Unable to map connection limits: %s\n", strerror(errno));
+        Limits = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Return index of counter of client with numeric address host.
+ **/
+static unsigned int
+limits_client(const char *host)
+{
+    return hash_string(host, false) % LIMITS_CLIENT_SLOTS;
+}
+
+/**
+ * Release connection counted against client counter admitted - 1.
+ **/
+static void
+limits_drop(unsigned int admitted)
+{
+    __atomic_sub_fetch(&Limits->connections, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&Limits->clients[admitted - 1], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Admit accepted connection if neither MaxConnections connections in all,
+ * nor MaxClientConnections from its client, are open already.
+ *
+ * A connection that is turned away is sent a 503 Service Unavailable
+ * response (if the socket takes it at once) and is not admitted.  Admitted
+ * connections must be released with limits_release.
+ **/
+bool
+limits_admit(struct request *r)
+{
+    static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    unsigned int client;
+
+    if (Limits == NULL)
+        return true;
+
+    if (__atomic_add_fetch(&Limits->connections, 1, __ATOMIC_RELAXED) > MaxConnections && MaxConnections)
+        goto busy;
+
+    client = limits_client(r->host);
+    if (__atomic_add_fetch(&Limits->clients[client], 1, __ATOMIC_RELAXED) > MaxClientConnections && MaxClientConnections) {
+        __atomic_sub_fetch(&Limits->clients[client], 1, __ATOMIC_RELAXED);
+        goto busy;
+    }
+
+    r->admitted = client + 1;
+    if (Held)
+        __atomic_store_n(Held, r->admitted, __ATOMIC_RELEASE);
+    return true;
+
+busy:
+    __atomic_sub_fetch(&Limits->connections, 1, __ATOMIC_RELAXED);
+    debug("Turning away connection from %s:%s", r->host, r->port);
+    send(r->fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    metrics_status(HTTP_STATUS_SERVICE_UNAVAILABLE);
+    return false;
+}
+
+/**
+ * Release connection admitted by limits_admit.
+ **/
+void
+limits_release(struct request *r)
+{
+    if (!r->admitted)
+        return;
+
+    if (Held)
+        __atomic_store_n(Held, 0, __ATOMIC_RELEASE);
+    limits_drop(r->admitted);
+    r->admitted = 0;
+}
+
+/**
+ * Record each admission of this process (which handles one connection at a
+ * time) at held, in memory shared with its supervisor, until it is
+ * released.
+ **/
+void
+limits_record(unsigned int *held)
+{
+    Held = held;
+}
+
+/**
+ * Release admission recorded at held by a process that has exited.
+ **/
+void
+limits_release_held(unsigned int *held)
+{
+    unsigned int admitted = __atomic_exchange_n(held, 0, __ATOMIC_ACQ_REL);
+
+    if (admitted && Limits)
+        limits_drop(admitted);
+}
+
+/**
+ * Note admission of request, which child process pid now serves (and
+ * releases when it is done), in case the child dies first (see
+ * limits_reap).  The parent's copy of request no longer holds it.
+ **/
+void
+limits_hand_off(struct request *r, pid_t pid)
+{
+    struct limits_child *children;
+
+    if (!r->admitted)
+        return;
+
+    if (NChildren == CChildren) {
+        size_t capacity = CChildren ? CChildren * 2 : 64;
+
+        if ((children = realloc(Children, capacity * sizeof(struct limits_child))) == NULL) {
+            r->admitted = 0;
+            return;
+        }
+        Children  = children;
+        CChildren = capacity;
+    }
+
+    Children[NChildren++] = (struct limits_child){ pid, r->admitted };
+    r->admitted = 0;
+}
+
+/**
+ * Forget admission noted for child process pid, which has exited, releasing
+ * it unless the child released it itself (exited normally).
+ **/
+void
+limits_reap(pid_t pid, bool released)
+{
+    for (size_t i = 0; i < NChildren; i++) {
+        if (Children[i].pid == pid) {
+            if (!released)
+                limits_drop(Children[i].admitted);
+            Children[i] = Children[--NChildren];
+            return;
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,247 @@
+/* listing.c: Directory Listings */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define LISTING_CACHE_SLOTS 64  /* Directories whose sorted names are kept */
+
+/* Listing Cache: the sorted names of recently listed directories, in a
+ * direct-mapped table keyed by path.  Each listing records the version
+ * (identity, mtime and ctime) of the directory it was read from, and is
+ * only reused while the directory keeps that version; adding, removing or
+ * renaming an entry changes the directory's mtime.  Listings are shared by
+ * reference, so a page still being sent keeps its listing alive after a
+ * newer one replaced it. */
+
+static struct {
+    struct listing *slots[LISTING_CACHE_SLOTS];
+    pthread_mutex_t lock;
+} Listings = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Free listing.
+ **/
+static void
+listing_free(struct listing *l)
+{
+    free(l->path);
+    free(l->names);
+    free(l->storage);
+    free(l);
+}
+
+/**
+ * Determine whether listing was read from the directory at path while it
+ * had the stat s.
+ **/
+static bool
+listing_current(const struct listing *l, const char *path, const struct stat *s)
+{
+    return streq(l->path, path) && l->dev == s->st_dev && l->ino == s->st_ino &&
+           l->mtime.tv_sec == s->st_mtim.tv_sec && l->mtime.tv_nsec == s->st_mtim.tv_nsec &&
+           l->ctime.tv_sec == s->st_ctim.tv_sec && l->ctime.tv_nsec == s->st_ctim.tv_nsec;
+}
+
+/**
+ * Compare names for qsort, in the same order as alphasort.
+ **/
+static int
+listing_compare(const void *a, const void *b)
+{
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Read names of the entries of directory at path, sorted as with alphasort.
+ *
+ * The names are packed into a single block of storage, so that a large
+ * directory costs little more than its names.  Returns NULL on error.
+ **/
+static struct listing *
+listing_read(const char *path, const struct stat *s)
+{
+    struct listing *l;
+    DIR           *dir;
+    struct dirent *d;
+    size_t        *offsets = NULL;
+    size_t         used = 0, capacity = 0, slots = 0;
+    size_t         length;
+
+    if ((dir = opendir(path)) == NULL)
+        return NULL;
+    if ((l = calloc(1, sizeof(struct listing))) == NULL || (l->path = strdup(path)) == NULL)
+        goto fail;
+
+    while ((d = readdir(dir)) != NULL) {
+        length = strlen(d->d_name) + 1;
+        if (used + length > capacity) {
+            char *storage = realloc(l->storage, capacity = 2 * (capacity + length));
+            if (storage == NULL)
+                goto fail;
+            l->storage = storage;
+        }
+        if (l->count == slots) {
+            size_t *grown = realloc(offsets, (slots = slots ? 2 * slots : 64) * sizeof(size_t));
+            if (grown == NULL)
+                goto fail;
+            offsets = grown;
+        }
+
+        memcpy(l->storage + used, d->d_name, length);
+        offsets[l->count++] = used;
+        used += length;
+    }
+
+    /* Storage no longer moves: turn offsets into names */
+    if ((l->names = malloc((l->count ? l->count : 1) * sizeof(char *))) == NULL)
+        goto fail;
+    for (size_t i = 0; i < l->count; i++)
+        l->names[i] = l->storage + offsets[i];
+    qsort(l->names, l->count, sizeof(char *), listing_compare);
+
+    l->dev   = s->st_dev;
+    l->ino   = s->st_ino;
+    l->mtime = s->st_mtim;
+    l->ctime = s->st_ctim;
+    l->refs  = 1;
+
+    free(offsets);
+    closedir(dir);
+    return l;
+
+fail:
+    fprintf(stderr, "Unable to list %s: %s\n", path, strerror(errno));
+    free(offsets);
+    closedir(dir);
+    if (l)
+        listing_free(l);
+    return NULL;
+}
+
+/**
+ * Return the sorted names of the entries of directory at path, whose stat
+ * (taken before calling this, so that changes meanwhile are noticed) is s.
+ *
+ * Listings are kept in the listing cache (unless the file cache is disabled
+ * with CacheBytes) and reused while the directory is unchanged, so paging
+ * through a large directory reads and sorts it only once.  Returns the
+ * listing, which must be released with listing_close, or NULL on error.
+ **/
+struct listing *
+listing_open(const char *path, const struct stat *s)
+{
+    struct listing *l, **slot = &Listings.slots[hash_string(path, false) % LISTING_CACHE_SLOTS];
+    struct listing *old = NULL;
+
+    if (CacheBytes > 0) {
+        pthread_mutex_lock(&Listings.lock);
+        if ((l = *slot) != NULL && listing_current(l, path, s)) {
+            l->refs++;
+            pthread_mutex_unlock(&Listings.lock);
+            return l;
+        }
+        pthread_mutex_unlock(&Listings.lock);
+    }
+
+    if ((l = listing_read(path, s)) == NULL || CacheBytes == 0)
+        return l;
+
+    pthread_mutex_lock(&Listings.lock);
+    if (*slot && --(*slot)->refs == 0)
+        old = *slot;
+    *slot = l;
+    l->refs++;
+    pthread_mutex_unlock(&Listings.lock);
+
+    if (old)
+        listing_free(old);
+    return l;
+}
+
+/**
+ * Copy s to p (ending before end), escaped for use in HTML text and
+ * attribute values if escape is set.  Returns the new end of p, or NULL if
+ * s does not fit (or p is already NULL).
+ **/
+static char *
+listing_copy(char *p, char *end, const char *s, bool escape)
+{
+    const char *copy;
+    size_t      length;
+
+    for (; p && *s; s++) {
+        copy   = s;
+        length = 1;
+        if (escape) {
+            switch (*s) {
+                case '&':   copy = "&amp;";  length = 5; break;
+                case '<':   copy = "&lt;";   length = 4; break;
+                case '>':   copy = "&gt;";   length = 4; break;
+                case '"':   copy = "&quot;"; length = 6; break;
+            }
+        }
+        if ((size_t)(end - p) < length)
+            return NULL;
+        memcpy(p, copy, length);
+        p += length;
+    }
+    return p;
+}
+
+/**
+ * Render HTML list items for entries from *next up to (not including)
+ * last into buffer, each linking to base (the URI of the directory,
+ * without a trailing slash) followed by the entry's name.
+ *
+ * Only whole items are rendered, as many as fit in size bytes, and *next is
+ * advanced past them.  Returns the number of bytes rendered.
+ **/
+size_t
+listing_render(char *buffer, size_t size, const struct listing *l, size_t *next, size_t last, const char *base)
+{
+    char *p = buffer, *end = buffer + size, *item;
+
+    for (; *next < last && *next < l->count; (*next)++) {
+        item = listing_copy(p, end, "<li><a href=\"", false);
+        item = listing_copy(item, end, base, true);
+        item = listing_copy(item, end, "/", false);
+        item = listing_copy(item, end, l->names[*next], true);
+        item = listing_copy(item, end, "\"> ", false);
+        item = listing_copy(item, end, l->names[*next], true);
+        item = listing_copy(item, end, "</a></li>\n", false);
+        if (item == NULL)
+            break;
+        p = item;
+    }
+    return p - buffer;
+}
+
+/**
+ * Release listing returned by listing_open.
+ **/
+void
+listing_close(struct listing *l)
+{
+    bool last;
+
+    pthread_mutex_lock(&Listings.lock);
+    last = --l->refs == 0;
+    pthread_mutex_unlock(&Listings.lock);
+
+    if (last)
+        listing_free(l);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,250 @@
+/* metrics.c: Request Metrics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define METRICS_SLOTS		64      /* Counter sets, each claimed by a thread or process */
+#define METRICS_BUCKETS		24      /* Histogram buckets: up to 1, 2, 4, ... 2^23 microseconds */
+#define METRICS_STATUS_MAX	16      /* Above the number of http_status values */
+
+/* Metrics: counters live in shared memory, so forked workers (and children
+ * of the forking server) add to the same totals as the process that serves
+ * the metrics URI.  Each thread or process claims a slot of its own, so
+ * updates are uncontended atomic adds that never share a cache line; slots
+ * are only summed when the metrics are rendered. */
+
+struct histogram {
+    uint64_t counts[METRICS_BUCKETS + 1];   /*< Last bucket counts everything slower */
+    uint64_t sum;                           /*< Total nanoseconds */
+};
+
+struct metrics_slot {
+    uint64_t connections;                   /*< Connections accepted */
+    uint64_t sent;                          /*< Bytes sent to clients */
+    uint64_t statuses[METRICS_STATUS_MAX];  /*< Requests by http_status */
+    struct histogram stages[METRICS_STAGES];
+} __attribute__((aligned(64)));
+
+struct metrics {
+    unsigned int        claimed;            /*< Slots handed out (modulo METRICS_SLOTS) */
+    struct metrics_slot slots[METRICS_SLOTS];
+};
+
+static struct metrics *Metrics = NULL;
+static __thread struct metrics_slot *Slot = NULL;
+
+static const char *StageNames[METRICS_STAGES] = {
+    [METRICS_ACCEPT]                    = "accept",
+    [METRICS_PARSE]                     = "parse",
+    [METRICS_RESOLVE]                   = "resolve",
+    [METRICS_REQUEST]                   = "request",
+    [METRICS_HANDLER + REQUEST_BROWSE]  = "browse",
+    [METRICS_HANDLER + REQUEST_FILE]    = "file",
+    [METRICS_HANDLER + REQUEST_CGI]     = "cgi",
+    [METRICS_HANDLER + REQUEST_BAD]     = "bad",
+};
+
+/**
+ * Forget the parent's slot in a forked child, so it claims its own.
+ **/
+static void
+metrics_forked(void)
+{
+    Slot = NULL;
+}
+
+/**
+ * Map counters into memory shared with every process forked from now on.
+ * Until this is called, nothing is recorded.  Returns false on error.
+ **/
+bool
+metrics_init(void)
+{
+    Metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Metrics == MAP_FAILED) {
+        fprintf(stderr, "Unable to map metrics: %s\n", strerror(errno));
+        Metrics = NULL;
+        return false;
+    }
+    pthread_atfork(NULL, NULL, metrics_forked);
+    return true;
+}
+
+/**
+ * Return slot of the calling thread, claiming one on first use (or NULL if
+ * metrics are not initialized).
+ **/
+static inline struct metrics_slot *
+metrics_slot(void)
+{
+    if (Slot == NULL && Metrics != NULL)
+        Slot = &Metrics->slots[__atomic_fetch_add(&Metrics->claimed, 1, __ATOMIC_RELAXED) % METRICS_SLOTS];
+    return Slot;
+}
+
+static inline void
+metrics_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return monotonic time in nanoseconds.
+ **/
+unsigned long long
+metrics_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Record time spent in stage since start (from metrics_now), and return the
+ * current time, so consecutive stages can share each reading of the clock.
+ **/
+unsigned long long
+metrics_record(metrics_stage stage, unsigned long long start)
+{
+    unsigned long long now = metrics_now();
+    unsigned long long us  = (now - start) / 1000;
+    struct metrics_slot *slot = metrics_slot();
+    size_t bucket;
+
+    if (slot == NULL || start == 0)
+        return now;
+
+    /* Bucket i holds durations of at most 2^i microseconds */
+    bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS;
+    metrics_add(&slot->stages[stage].counts[bucket], 1);
+    metrics_add(&slot->stages[stage].sum, now - start);
+    return now;
+}
+
+/**
+ * Count accepted connection.
+ **/
+void
+metrics_connection(void)
+{
+    struct metrics_slot *slot = metrics_slot();
+
+    if (slot)
+        metrics_add(&slot->connections, 1);
+}
+
+/**
+ * Count request answered with status.
+ **/
+void
+metrics_status(http_status status)
+{
+    struct metrics_slot *slot = metrics_slot();
+
+    if (slot && status < METRICS_STATUS_MAX)
+        metrics_add(&slot->statuses[status], 1);
+}
+
+/**
+ * Count bytes sent to a client.
+ **/
+void
+metrics_sent(size_t bytes)
+{
+    struct metrics_slot *slot = metrics_slot();
+
+    if (slot)
+        metrics_add(&slot->sent, bytes);
+}
+
+/**
+ * Sum counter at offset (in bytes) within each slot.
+ **/
+static uint64_t
+metrics_sum(size_t offset)
+{
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < METRICS_SLOTS; i++)
+        total += __atomic_load_n((uint64_t *)((char *)&Metrics->slots[i] + offset), __ATOMIC_RELAXED);
+    return total;
+}
+
+/**
+ * Write histograms of stages first up to (not including) last, labelled
+ * with label, as Prometheus histogram family name.
+ **/
+static void
+metrics_render_histograms(FILE *fs, const char *name, const char *help, const char *label,
+                          metrics_stage first, metrics_stage last)
+{
+    fprintf(fs, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (metrics_stage stage = first; stage < last; stage++) {
+        uint64_t count = 0;
+
+        for (size_t bucket = 0; bucket <= METRICS_BUCKETS; bucket++) {
+            count += metrics_sum(offsetof(struct metrics_slot, stages[stage].counts[bucket]));
+            if (bucket < METRICS_BUCKETS)
+                fprintf(fs, "%s_bucket{%s=\"%s\",le=\"%.6f\"} %llu\n", name, label, StageNames[stage],
+                        (double)(1ULL << bucket) / 1e6, (unsigned long long)count);
+        }
+        fprintf(fs, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, StageNames[stage], (unsigned long long)count);
+        fprintf(fs, "%s_sum{%s=\"%s\"} %.9f\n", name, label, StageNames[stage],
+                metrics_sum(offsetof(struct metrics_slot, stages[stage].sum)) / 1e9);
+        fprintf(fs, "%s_count{%s=\"%s\"} %llu\n", name, label, StageNames[stage], (unsigned long long)count);
+    }
+}
+
+/**
+ * Write totals over every slot in the Prometheus text exposition format.
+ **/
+void
+metrics_render(FILE *fs)
+{
+    if (Metrics == NULL)
+        return;
+
+    fprintf(fs, "# HELP spidey_connections_total Connections accepted.\n"
+                "# TYPE spidey_connections_total counter\n"
+                "spidey_connections_total %llu\n",
+            (unsigned long long)metrics_sum(offsetof(struct metrics_slot, connections)));
+
+    fprintf(fs, "# HELP spidey_requests_total Requests answered, by status code.\n"
+                "# TYPE spidey_requests_total counter\n");
+    for (http_status status = 0; status < METRICS_STATUS_MAX; status++) {
+        uint64_t count = metrics_sum(offsetof(struct metrics_slot, statuses[status]));
+        if (count > 0)
+            fprintf(fs, "spidey_requests_total{code=\"%.3s\"} %llu\n", http_status_string(status), (unsigned long long)count);
+    }
+
+    fprintf(fs, "# HELP spidey_sent_bytes_total Bytes sent to clients.\n"
+                "# TYPE spidey_sent_bytes_total counter\n"
+                "spidey_sent_bytes_total %llu\n",
+            (unsigned long long)metrics_sum(offsetof(struct metrics_slot, sent)));
+
+    fprintf(fs, "# HELP spidey_access_log_dropped_total Access log entries dropped.\n"
+                "# TYPE spidey_access_log_dropped_total counter\n"
+                "spidey_access_log_dropped_total %llu\n", accesslog_dropped());
+
+    metrics_render_histograms(fs, "spidey_stage_duration_seconds",
+                              "Time spent setting up connections, receiving and parsing requests, "
+                              "resolving paths, and handling whole requests.",
+                              "stage", METRICS_ACCEPT, METRICS_HANDLER);
+    metrics_render_histograms(fs, "spidey_handler_duration_seconds",
+                              "Time spent in request handlers, by request type.",
+                              "type", METRICS_HANDLER, METRICS_STAGES);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
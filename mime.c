@@ -0,0 +1,224 @@
+/* mime.c: MIME type table */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+/* Constants */
+
+#define MIME_EXTENSION_MAX	32
+
+/* MIME Table */
+
+struct mime_entry {
+    const char *extension;  /*< Lower-case extension (without the dot) */
+    const char *mimetype;   /*< Interned mimetype */
+};
+
+struct mime_table {
+    char              *data;        /*< Contents of MimeTypesPath, tokenized in place */
+    struct mime_entry *entries;     /*< Open-addressed hash table */
+    size_t             capacity;    /*< Number of entries (power of two) */
+};
+
+static struct mime_table   *MimeTable = NULL;
+static pthread_rwlock_t     MimeLock  = PTHREAD_RWLOCK_INITIALIZER;  /* Held for reading by lookups */
+static volatile sig_atomic_t MimeReload = 0;
+
+/**
+ * Free table.
+ **/
+static void
+mime_free(struct mime_table *table)
+{
+    if (table == NULL)
+        return;
+
+    free(table->entries);
+    free(table->data);
+    free(table);
+}
+
+/**
+ * Insert extension into table, keeping the first mimetype listed for it.
+ **/
+static void
+mime_insert(struct mime_table *table, char *extension, const char *mimetype)
+{
+    size_t mask = table->capacity - 1;
+
+    for (char *c = extension; *c; c++)
+        *c = tolower((unsigned char)*c);
+
+    for (size_t i = hash_string(extension, false) & mask; ; i = (i + 1) & mask) {
+        if (table->entries[i].extension == NULL) {
+            table->entries[i].extension = extension;
+            table->entries[i].mimetype  = mimetype;
+            return;
+        }
+        if (streq(table->entries[i].extension, extension))
+            return;
+    }
+}
+
+/**
+ * Read MimeTypesPath into a new hash table.
+ *
+ * The file is read in one go and tokenized in place, so every extension and
+ * mimetype in the table points into a single buffer and each mimetype string
+ * is shared by all of its extensions.
+ **/
+static struct mime_table *
+mime_read(const char *path)
+{
+    struct mime_table *table;
+    FILE              *fs;
+    struct stat        s;
+    size_t             length, words = 0;
+    char              *line, *mimetype, *token, *lstate, *tstate;
+
+    if ((fs = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if ((table = calloc(1, sizeof(struct mime_table))) == NULL || fstat(fileno(fs), &s) < 0 ||
+        (table->data = malloc(s.st_size + 1)) == NULL) {
+        fprintf(stderr, "Unable to load %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    length = fread(table->data, 1, s.st_size, fs);
+    table->data[length] = '\0';
+
+    /* Size table for a load factor of at most one half */
+    for (size_t i = 0; i < length; i++)
+        words += isspace((unsigned char)table->data[i]) && !isspace((unsigned char)table->data[i + 1]);
+    for (table->capacity = 64; table->capacity < 2 * words; table->capacity *= 2);
+
+    if ((table->entries = calloc(table->capacity, sizeof(struct mime_entry))) == NULL) {
+        fprintf(stderr, "Unable to load %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    /* Add each extension of each "<MIMETYPE> <EXT1> <EXT2> ..." rule */
+    for (line = strtok_r(table->data, "\n", &lstate); line; line = strtok_r(NULL, "\n", &lstate)) {
+        mimetype = strtok_r(skip_whitespace(line), WHITESPACE, &tstate);
+        if (mimetype == NULL || *mimetype == '#')
+            continue;
+        while ((token = strtok_r(NULL, WHITESPACE, &tstate)))
+            mime_insert(table, token, mimetype);
+    }
+
+    fclose(fs);
+    return table;
+
+fail:
+    fclose(fs);
+    mime_free(table);
+    return NULL;
+}
+
+/**
+ * Load MimeTypesPath into the MIME table, replacing the current one.
+ *
+ * The new table is read before taking MimeLock, so lookups in other threads
+ * only wait for the swap; the old table is freed once none of them can
+ * still be reading it.
+ **/
+int
+mime_load(void)
+{
+    struct mime_table *table = mime_read(MimeTypesPath);
+    struct mime_table *old;
+
+    if (table == NULL)
+        return -1;
+
+    pthread_rwlock_wrlock(&MimeLock);
+    old       = MimeTable;
+    MimeTable = table;
+    pthread_rwlock_unlock(&MimeLock);
+    mime_free(old);
+
+    debug("Loaded MIME types from %s", MimeTypesPath);
+    return 0;
+}
+
+/**
+ * SIGHUP handler: request the MIME table be reloaded.
+ **/
+void
+mime_hangup(int signum)
+{
+    MimeReload = 1;
+}
+
+/**
+ * Reload the MIME table if a SIGHUP arrived since the last check, returning
+ * whether it was reloaded.
+ **/
+bool
+mime_refresh(void)
+{
+    if (!MimeReload || !__atomic_exchange_n(&MimeReload, 0, __ATOMIC_ACQ_REL))
+        return false;
+
+    log("Reloading MIME types from %s", MimeTypesPath);
+    return mime_load() == 0;
+}
+
+/**
+ * Determine mime-type from file extension
+ *
+ * This function finds the file's extension and looks it up (ignoring case)
+ * in the table loaded from MimeTypesPath by mime_load.
+ *
+ * If no extension exists or no matching mimetype is found, then return
+ * DefaultMimeType.
+ *
+ * The table may be replaced (and freed) by a reload at any time after the
+ * lookup, so a matching mimetype is returned as a copy allocated from arena.
+ **/
+const char *
+determine_mimetype(struct arena *arena, const char *path)
+{
+    const char        *mimetype = NULL;
+    char               extension[MIME_EXTENSION_MAX];
+    const char        *ext;
+    size_t             i, mask;
+
+    mime_refresh();
+
+    /* Find file extension */
+    ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL || strlen(ext + 1) >= MIME_EXTENSION_MAX)
+        return DefaultMimeType;
+
+    for (i = 0; ext[i + 1]; i++)
+        extension[i] = tolower((unsigned char)ext[i + 1]);
+    extension[i] = '\0';
+
+    /* Look up extension */
+    pthread_rwlock_rdlock(&MimeLock);
+    if (MimeTable != NULL) {
+        mask = MimeTable->capacity - 1;
+        for (i = hash_string(extension, false) & mask; MimeTable->entries[i].extension; i = (i + 1) & mask) {
+            if (streq(MimeTable->entries[i].extension, extension)) {
+                mimetype = arena_strdup(arena, MimeTable->entries[i].mimetype);
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&MimeLock);
+
+    return mimetype ? mimetype : DefaultMimeType;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
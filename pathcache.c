@@ -0,0 +1,246 @@
+/* pathcache.c: Request Path Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PATH_WATCH_EVENTS   (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* Path Cache */
+
+struct path_entry {
+    char          *uri;         /*< Request URI (NULL = empty slot) */
+    char          *path;        /*< Resolved path (NULL = not found) */
+    request_type   type;        /*< Request type of path */
+    unsigned long  generation;  /*< Generation the entry was resolved in */
+};
+
+struct path_cache {
+    struct path_entry *entries;     /*< Direct-mapped slots (PathCacheSize) */
+    unsigned long      generation;  /*< Bumped on every change under RootPath */
+    bool               watching;    /*< Watcher thread started in this process */
+    bool               disabled;    /*< Unable to watch RootPath */
+    int                ifd;         /*< inotify descriptor */
+    char             **watches;     /*< Watched directory by watch descriptor */
+    size_t             nwatches;    /*< Capacity of watches */
+    pthread_mutex_t    lock;
+};
+
+static struct path_cache Paths = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Watch directory for changes, remembering its path by watch descriptor.
+ **/
+static int
+path_watch(const char *path)
+{
+    int    wd;
+    char **watches;
+
+    if ((wd = inotify_add_watch(Paths.ifd, path, PATH_WATCH_EVENTS)) < 0) {
+        fprintf(stderr, "Unable to watch %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if ((size_t)wd >= Paths.nwatches) {
+        size_t nwatches = (wd + 1) * 2;
+        if ((watches = realloc(Paths.watches, nwatches * sizeof(char *))) == NULL)
+            return -1;
+        memset(watches + Paths.nwatches, 0, (nwatches - Paths.nwatches) * sizeof(char *));
+        Paths.watches  = watches;
+        Paths.nwatches = nwatches;
+    }
+
+    free(Paths.watches[wd]);
+    Paths.watches[wd] = strdup(path);
+    return 0;
+}
+
+static int
+path_watch_tree_entry(const char *path, const struct stat *s, int flag, struct FTW *ftw)
+{
+    if (flag == FTW_D)
+        path_watch(path);
+    return 0;
+}
+
+/**
+ * Watch directory and every directory below it.
+ **/
+static int
+path_watch_tree(const char *path)
+{
+    return nftw(path, path_watch_tree_entry, 16, FTW_PHYS);
+}
+
+/**
+ * Watcher thread: invalidate the cache whenever anything under RootPath
+ * changes, and watch new directories as they appear.
+ **/
+static void *
+path_watcher(void *arg)
+{
+    char    buffer[BUFSIZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char    path[BUFSIZ];
+    ssize_t nread;
+
+    while ((nread = read(Paths.ifd, buffer, sizeof(buffer))) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Unable to read inotify events: %s\n", strerror(errno));
+            break;
+        }
+
+        __atomic_add_fetch(&Paths.generation, 1, __ATOMIC_RELEASE);
+
+        for (char *p = buffer; p < buffer + nread; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                event->wd >= 0 && (size_t)event->wd < Paths.nwatches && Paths.watches[event->wd]) {
+                snprintf(path, sizeof(path), "%s/%s", Paths.watches[event->wd], event->name);
+                path_watch_tree(path);
+                __atomic_add_fetch(&Paths.generation, 1, __ATOMIC_RELEASE);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    /* Stop caching once changes can no longer be seen */
+    __atomic_store_n(&Paths.disabled, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Start watching RootPath in this process (must hold Paths.lock).
+ **/
+static void
+path_cache_start(void)
+{
+    pthread_t thread;
+    int       status;
+
+    Paths.watching = true;
+    if (Paths.entries == NULL && (Paths.entries = calloc(PathCacheSize, sizeof(struct path_entry))) == NULL) {
+        fprintf(stderr, "Unable to allocate path cache: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    if ((Paths.ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to create inotify: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    if (path_watch_tree(RootPath) < 0 || (status = pthread_create(&thread, NULL, path_watcher, NULL)) != 0) {
+        fprintf(stderr, "Unable to watch %s\n", RootPath);
+        close(Paths.ifd);
+        goto fail;
+    }
+    pthread_detach(thread);
+    return;
+
+fail:
+    Paths.disabled = true;
+}
+
+/**
+ * After fork, the child has neither the watcher thread nor its events: start
+ * over with an empty cache.
+ **/
+static void
+path_cache_child(void)
+{
+    pthread_mutex_init(&Paths.lock, NULL);
+    if (Paths.watching && !Paths.disabled)
+        close(Paths.ifd);
+    Paths.watching = false;
+    Paths.disabled = false;
+    Paths.generation++;
+}
+
+static void __attribute__((constructor))
+path_cache_init(void)
+{
+    pthread_atfork(NULL, NULL, path_cache_child);
+}
+
+/**
+ * Resolve request URI to its real path and request type.
+ *
+ * Results of determine_request_path and determine_request_type are cached
+ * in a direct-mapped table of PathCacheSize slots.  Every change under
+ * RootPath (reported by inotify) starts a new generation, which invalidates
+ * all cached results at once.
+ *
+ * Returns the real path, allocated from arena (or NULL if the URI does not
+ * map to a path under RootPath), and stores its type in type.  URIs too long
+ * to resolve are not cached, and leave errno set to ENAMETOOLONG.
+ **/
+char *
+resolve_request_path(struct arena *arena, const char *uri, request_type *type)
+{
+    struct path_entry *entry;
+    unsigned long generation;
+    char *path;
+
+    if (PathCacheSize == 0)
+        goto uncached;
+
+    pthread_mutex_lock(&Paths.lock);
+    if (!Paths.watching)
+        path_cache_start();
+    if (__atomic_load_n(&Paths.disabled, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&Paths.lock);
+        goto uncached;
+    }
+
+    /* Look up URI */
+    generation = __atomic_load_n(&Paths.generation, __ATOMIC_ACQUIRE);
+    entry = &Paths.entries[hash_string(uri, false) % PathCacheSize];
+    if (entry->uri && entry->generation == generation && streq(entry->uri, uri)) {
+        path  = entry->path ? arena_strdup(arena, entry->path) : NULL;
+        *type = entry->type;
+        pthread_mutex_unlock(&Paths.lock);
+        if (!path)
+            errno = ENOENT;
+        return path;
+    }
+    pthread_mutex_unlock(&Paths.lock);
+
+    /* Resolve URI, then cache the result under the generation it started in,
+     * so that a change made meanwhile invalidates it */
+    path  = determine_request_path(arena, uri);
+    *type = path ? determine_request_type(path) : REQUEST_BAD;
+    if (!path && errno == ENAMETOOLONG)
+        return NULL;
+
+    pthread_mutex_lock(&Paths.lock);
+    free(entry->uri);
+    free(entry->path);
+    entry->uri        = strdup(uri);
+    entry->path       = path ? strdup(path) : NULL;
+    entry->type       = *type;
+    entry->generation = generation;
+    pthread_mutex_unlock(&Paths.lock);
+    return path;
+
+uncached:
+    path  = determine_request_path(arena, uri);
+    *type = path ? determine_request_type(path) : REQUEST_BAD;
+    return path;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
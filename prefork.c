@@ -0,0 +1,235 @@
+/* prefork.c: Pre-Forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SPAWN_RATE_MAX	32
+
+/* Scoreboard */
+
+typedef enum {
+    SLOT_EMPTY,             /**< No worker */
+    SLOT_IDLE,              /**< Worker waiting in accept */
+    SLOT_BUSY,              /**< Worker handling a request */
+    SLOT_STOPPING,          /**< Worker asked to exit */
+} slot_state;
+
+struct slot {
+    pid_t         pid;      /*< Worker process ID */
+    int           state;    /*< Worker state (slot_state), updated atomically */
+    unsigned long requests; /*< Number of requests handled by worker */
+    unsigned int  admitted; /*< Connection limit counters held by worker (see limits_record) */
+};
+
+static struct slot *Scoreboard = NULL;  /* Shared with workers: PreforkMax slots */
+
+/* Worker */
+
+static volatile sig_atomic_t Stopping = 0;
+
+static void
+prefork_stop(int signum)
+{
+    Stopping = 1;
+}
+
+/**
+ * Worker process: accept and handle requests on the shared server socket
+ * until asked to stop or PreforkRequests requests have been handled (the
+ * connection that reaches the limit is served to its end first).
+ **/
+static void
+prefork_worker(int sfd, struct slot *slot)
+{
+    struct sigaction action = { .sa_handler = prefork_stop };   /* No SA_RESTART: interrupt accept */
+    struct request *request;
+    sigset_t mask;
+
+    sigaction(SIGTERM, &action, NULL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    limits_record(&slot->admitted);
+
+    while (!Stopping && (PreforkRequests == 0 || slot->requests < PreforkRequests)) {
+        request = accept_request(sfd);
+        if (request == NULL) {
+            continue;
+        }
+
+        /* The supervisor may have picked this idle worker to stop while it
+         * was accepting: serve the connection it got, then exit */
+        if (!__atomic_compare_exchange_n(&slot->state, &(int){SLOT_IDLE}, SLOT_BUSY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            Stopping = 1;
+
+        slot->requests += handle_connection(request);
+        free_request(request);
+        __atomic_store_n(&slot->state, Stopping ? SLOT_STOPPING : SLOT_IDLE, __ATOMIC_RELEASE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+/* Supervisor */
+
+/**
+ * Fork worker process into scoreboard slot.
+ **/
+static int
+prefork_spawn(int sfd, struct slot *slot)
+{
+    pid_t pid;
+
+    slot->pid      = 0;
+    slot->requests = 0;
+    slot->admitted = 0;
+    __atomic_store_n(&slot->state, SLOT_IDLE, __ATOMIC_RELEASE);
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        __atomic_store_n(&slot->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    if (pid == 0) {
+        prefork_worker(sfd, slot);
+    }
+
+    slot->pid = pid;
+    return 0;
+}
+
+/**
+ * Reap exited workers, freeing their scoreboard slots and releasing the
+ * connections of those that died while serving one.
+ **/
+static void
+prefork_reap(void)
+{
+    pid_t pid;
+    int   status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < PreforkMax; i++) {
+            if (Scoreboard[i].pid != pid)
+                continue;
+
+            if (WIFSIGNALED(status)) {
+                log("Worker %d crashed with signal %d after %lu requests", pid, WTERMSIG(status), Scoreboard[i].requests);
+            } else {
+                debug("Worker %d exited after %lu requests", pid, Scoreboard[i].requests);
+            }
+            limits_release_held(&Scoreboard[i].admitted);
+            Scoreboard[i].pid = 0;
+            __atomic_store_n(&Scoreboard[i].state, SLOT_EMPTY, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+}
+
+/**
+ * Handle HTTP requests with a supervised pool of pre-forked workers.
+ *
+ * Each worker is a long-lived process that accepts on the shared server
+ * socket and handles many requests.  Workers publish whether they are idle
+ * or busy in a scoreboard in shared memory, which the parent checks once a
+ * second (or whenever a worker exits or SIGHUP arrives) to:
+ *
+ *  1. Respawn workers that exited, whether they crashed or were recycled
+ *     after PreforkRequests requests, so there are always PreforkMin.
+ *  2. Grow the pool towards PreforkMax while no worker is idle, doubling
+ *     the number spawned each consecutive second (up to SPAWN_RATE_MAX).
+ *  3. Shrink the pool towards PreforkMin, one worker a second, while more
+ *     than half of the workers are idle.
+ **/
+void
+prefork_server(int sfd)
+{
+    struct timespec timeout = { .tv_sec = 1 };
+    sigset_t mask;
+    size_t   rate = 1;
+    size_t   alive, idle, spawn;
+    time_t   now, shrunk = 0;
+
+    if (PreforkMax < PreforkMin)
+        PreforkMax = PreforkMin;
+
+    Scoreboard = mmap(NULL, PreforkMax * sizeof(struct slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Scoreboard == MAP_FAILED) {
+        fatal("Unable to allocate scoreboard: %s", strerror(errno));
+    }
+
+    /* Wake up early whenever a worker exits */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    while (true) {
+        prefork_reap();
+
+        /* Count workers */
+        alive = idle = 0;
+        for (size_t i = 0; i < PreforkMax; i++) {
+            int state = __atomic_load_n(&Scoreboard[i].state, __ATOMIC_ACQUIRE);
+            if (state == SLOT_EMPTY || state == SLOT_STOPPING)
+                continue;
+            alive++;
+            idle += (state == SLOT_IDLE);
+        }
+
+        /* Determine how many workers to spawn */
+        if (alive < PreforkMin) {
+            spawn = PreforkMin - alive;
+        } else if (idle == 0) {
+            spawn = rate;
+            rate  = rate * 2 > SPAWN_RATE_MAX ? SPAWN_RATE_MAX : rate * 2;
+        } else {
+            spawn = 0;
+            rate  = 1;
+        }
+
+        /* Grow pool */
+        for (size_t i = 0; i < PreforkMax && spawn > 0; i++) {
+            if (Scoreboard[i].state == SLOT_EMPTY && prefork_spawn(sfd, &Scoreboard[i]) == 0)
+                spawn--;
+        }
+
+        /* Shrink pool by stopping one idle worker (at most once a second,
+         * since each exiting worker also wakes us up) */
+        now = metrics_now() / 1000000000ULL;
+        if (idle > alive / 2 && alive > PreforkMin && now > shrunk) {
+            shrunk = now;
+            for (size_t i = 0; i < PreforkMax; i++) {
+                if (Scoreboard[i].pid > 0 && __atomic_compare_exchange_n(&Scoreboard[i].state, &(int){SLOT_IDLE}, SLOT_STOPPING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    kill(Scoreboard[i].pid, SIGTERM);
+                    break;
+                }
+            }
+        }
+
+        sigtimedwait(&mask, NULL, &timeout);
+
+        /* Pass SIGHUP on to the workers once our own MIME table (which new
+         * workers inherit) has been reloaded */
+        if (mime_refresh()) {
+            for (size_t i = 0; i < PreforkMax; i++) {
+                if (Scoreboard[i].pid > 0)
+                    kill(Scoreboard[i].pid, SIGHUP);
+            }
+        }
+    }
+
+    /* Close server socket and exit */
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,151 @@
+/* reactor.c: Multi-Reactor HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Reactor Shard */
+
+struct shard {
+    size_t    id;       /*< Shard index */
+    int       sfd;      /*< Shard's own SO_REUSEPORT listening socket */
+    int       cpu;      /*< CPU to pin shard to (-1 = no pinning) */
+    pthread_t thread;   /*< Thread running the shard's event loop */
+};
+
+/**
+ * Parse CPU list (e.g. "0,2,4-7") into cpus, returning the number of CPUs
+ * parsed (at most n).
+ **/
+static size_t
+reactor_parse_cpus(const char *list, int *cpus, size_t n)
+{
+    size_t count = 0;
+    char  *end;
+    long   first, last;
+
+    while (*list && count < n) {
+        first = last = strtol(list, &end, 10);
+        if (end == list)
+            break;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list)
+                break;
+        }
+        for (long cpu = first; cpu <= last && count < n; cpu++)
+            cpus[count++] = cpu;
+
+        list = (*end == ',') ? end + 1 : end;
+    }
+
+    return count;
+}
+
+/**
+ * Determine CPUs the shards are pinned to, returning the number of CPUs.
+ *
+ * By default, this is every CPU the process is allowed to run on.
+ **/
+static size_t
+reactor_cpus(int *cpus, size_t n)
+{
+    cpu_set_t set;
+    size_t    count = 0;
+
+    if (ReactorCPUs != NULL)
+        return reactor_parse_cpus(ReactorCPUs, cpus, n);
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Unable to get CPU affinity: %s\n", strerror(errno));
+        return 0;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < n; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[count++] = cpu;
+    }
+    return count;
+}
+
+/**
+ * Shard thread: pin to CPU and run an event loop on the shard's listener.
+ **/
+static void *
+reactor_shard(void *arg)
+{
+    struct shard *shard = arg;
+    cpu_set_t     set;
+    int           status;
+
+    if (shard->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(shard->cpu, &set);
+        if ((status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+            fprintf(stderr, "Unable to pin shard %zu to CPU %d: %s\n", shard->id, shard->cpu, strerror(status));
+        }
+    }
+
+    debug("Shard %zu listening on fd %d (CPU %d)", shard->id, shard->sfd, shard->cpu);
+    event_server(shard->sfd);
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with one event loop per shard.
+ *
+ * Each shard owns a SO_REUSEPORT listening socket on Port and runs its own
+ * event loop on its own thread, pinned to a CPU, so the kernel load-balances
+ * incoming connections across shards without a shared accept queue.  The
+ * server socket passed in (which must itself be SO_REUSEPORT) becomes the
+ * first shard's listener.
+ **/
+void
+reactor_server(int sfd)
+{
+    struct shard *shards;
+    int           cpus[CPU_SETSIZE];
+    size_t        ncpus = reactor_cpus(cpus, CPU_SETSIZE);
+    size_t        nshards = ReactorShards ? ReactorShards : (ncpus ? ncpus : 1);
+    int           status;
+
+    if ((shards = calloc(nshards, sizeof(struct shard))) == NULL) {
+        fatal("Unable to allocate shards: %s", strerror(errno));
+    }
+
+    /* Create listener for each shard */
+    for (size_t i = 0; i < nshards; i++) {
+        shards[i].id  = i;
+        shards[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+        shards[i].sfd = i == 0 ? sfd : socket_listen_reuseport(Port);
+        if (shards[i].sfd < 0) {
+            fatal("Unable to listen on port %s for shard %zu", Port, i);
+        }
+    }
+
+    log("Starting %zu reactor shards", nshards);
+
+    /* Run every shard but the first on its own thread */
+    for (size_t i = 1; i < nshards; i++) {
+        if ((status = pthread_create(&shards[i].thread, NULL, reactor_shard, &shards[i])) != 0) {
+            fatal("Unable to create shard thread: %s", strerror(status));
+        }
+    }
+
+    /* Run first shard on main thread */
+    reactor_shard(&shards[0]);
+
+    for (size_t i = 1; i < nshards; i++)
+        pthread_join(shards[i].thread, NULL);
+    free(shards);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,61 +1,216 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
 
+#include <sys/socket.h>
 #include <unistd.h>
 
-int parse_request_method(struct request *r);
-int parse_request_headers(struct request *r);
+int parse_request_method(struct request *r, char *buffer, char *end);
+int parse_request_header(struct request *r, char *buffer, char *colon, char *end);
+static bool request_keep_alive(struct request *r);
+
+/* Constants */
+
+#define REQUEST_POOL_MAX	64
+#define REQUEST_HEADERS_MIN	32
+#define HEADER_TABLE_SIZE	64      /* Power of two, well above HEADER_COUNT */
+
+/* Well-Known Headers */
+
+static const char *HeaderNames[HEADER_COUNT] = {
+    [HEADER_ACCEPT]             = "Accept",
+    [HEADER_ACCEPT_ENCODING]    = "Accept-Encoding",
+    [HEADER_ACCEPT_LANGUAGE]    = "Accept-Language",
+    [HEADER_CONNECTION]         = "Connection",
+    [HEADER_CONTENT_LENGTH]     = "Content-Length",
+    [HEADER_CONTENT_TYPE]       = "Content-Type",
+    [HEADER_COOKIE]             = "Cookie",
+    [HEADER_HOST]               = "Host",
+    [HEADER_IF_MODIFIED_SINCE]  = "If-Modified-Since",
+    [HEADER_IF_NONE_MATCH]      = "If-None-Match",
+    [HEADER_IF_RANGE]           = "If-Range",
+    [HEADER_RANGE]              = "Range",
+    [HEADER_REFERER]            = "Referer",
+    [HEADER_TRANSFER_ENCODING]  = "Transfer-Encoding",
+    [HEADER_USER_AGENT]         = "User-Agent",
+};
+
+static unsigned char HeaderTable[HEADER_TABLE_SIZE];   /* Hash of name -> header_id */
+
+/**
+ * Build open-addressed table of well-known header names.
+ **/
+static void __attribute__((constructor)) header_table_init(void) {
+    for (header_id id = HEADER_OTHER + 1; id < HEADER_COUNT; id++) {
+        size_t i = hash_string(HeaderNames[id], true);
+        while (HeaderTable[i % HEADER_TABLE_SIZE] != HEADER_OTHER)
+            i++;
+        HeaderTable[i % HEADER_TABLE_SIZE] = id;
+    }
+}
+
+/**
+ * Determine well-known ID of header name (ignoring case).
+ **/
+static header_id header_lookup(const char *name) {
+    header_id id;
+
+    for (size_t i = hash_string(name, true); (id = HeaderTable[i % HEADER_TABLE_SIZE]) != HEADER_OTHER; i++) {
+        if (strcasecmp(HeaderNames[id], name) == 0)
+            return id;
+    }
+    return HEADER_OTHER;
+}
+
+/**
+ * Return value of first header with well-known ID, or NULL if the client
+ * did not send it.
+ **/
+const char *request_header(struct request *r, header_id id) {
+    return r->known[id] ? r->headers[r->known[id] - 1].value : NULL;
+}
+
+/* Request Pool: free request structs, kept with their buffers for reuse */
+
+static struct request *RequestPool = NULL;
+static size_t          RequestPoolSize = 0;
+static pthread_mutex_t RequestPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Take request struct from the pool (or allocate one), with every field but
+ * its buffers zeroed.
+ **/
+static struct request *request_get(void) {
+    struct request *r;
+
+    pthread_mutex_lock(&RequestPoolLock);
+    if ((r = RequestPool) != NULL) {
+        RequestPool = r->pool;
+        RequestPoolSize--;
+    }
+    pthread_mutex_unlock(&RequestPoolLock);
+
+    if (r == NULL && (r = malloc(sizeof(struct request))) == NULL)
+        return NULL;
+
+    memset(r, 0, offsetof(struct request, buffer));
+    arena_init(&r->arena, r->scratch, sizeof(r->scratch));
+    return r;
+}
+
+/**
+ * Return request struct to the pool (or free it if the pool is full).
+ **/
+static void request_put(struct request *r) {
+    pthread_mutex_lock(&RequestPoolLock);
+    if (RequestPoolSize < REQUEST_POOL_MAX) {
+        r->pool     = RequestPool;
+        RequestPool = r;
+        RequestPoolSize++;
+        r = NULL;
+    }
+    pthread_mutex_unlock(&RequestPoolLock);
+    free(r);
+}
+
+/**
+ * Return deadline seconds after now (both as from metrics_now), or 0 (no
+ * deadline) if seconds is 0.
+ **/
+static unsigned long long request_deadline(unsigned long long now, unsigned int seconds) {
+    return seconds ? now + seconds * 1000000000ULL : 0;
+}
+
+/**
+ * Set timeouts of blocking reads and writes on client socket: reads wake up
+ * after the shortest of the read timeouts, in time to check the request's
+ * deadline (see parse_request), and writes fail once they make no progress
+ * for SendTimeout seconds.
+ **/
+static void request_timeouts(int fd) {
+    unsigned int timeouts[] = { KeepAliveTimeout, HeaderTimeout, BodyTimeout };
+    struct timeval timeout = { 0 };
+
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        if (timeouts[i] && (timeout.tv_sec == 0 || timeouts[i] < timeout.tv_sec))
+            timeout.tv_sec = timeouts[i];
+    }
+    if (timeout.tv_sec > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (SendTimeout > 0) {
+        timeout.tv_sec = SendTimeout;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+}
 
 /**
  * Accept request from server socket.
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
+ *  1. Takes a request struct from the request pool.
+ *  2. Initializes the headers array in the request struct.
  *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  4. Stores the client's numeric address and port in the request struct.
+ *     Host names are never looked up here, since a slow DNS server would
+ *     stall the acceptor (the access log uses resolve_host instead).
+ *  5. Turns the client away if it would exceed the connection limits.
+ *  6. Starts the clock on the first request: its headers must be in within
+ *     HeaderTimeout seconds of the connection.
+ *  7. Returns the request struct.
+ *
+ * Responses are written straight to the socket (see response.c).
  *
  * The returned request struct must be deallocated using free_request.
  **/
 struct request *accept_request(int sfd) {
     struct request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+    unsigned long long accepted;
 
     /* Allocate request struct (zeroed) */
-    r = calloc(1, sizeof(struct request));
-    r->headers = NULL;
-    /* Accept a client */
-    int rfd = accept(sfd, &raddr, &rlen);
+    r = request_get();
+    if (r == NULL) {
+        fprintf(stderr, "Unable to allocate request: %s\n", strerror(errno));
+        return NULL;
+    }
+    r->fd = -1;
+    /* Accept a client (close-on-exec, so CGI scripts never inherit it) */
+    int rfd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, SOCK_CLOEXEC);
     if (rfd < 0) {
-    fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
     goto fail;
     }
+    r->fd = rfd;
+    accepted = metrics_now();
+
+    request_timeouts(rfd);
 
     /* Lookup client information */
-    int status = getnameinfo(&raddr, sizeof(raddr), r->host, sizeof(r->host), r->port, sizeof(r->port), 0);
+    int status = getnameinfo((struct sockaddr *)&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
     if (status != 0 ){
         fprintf(stderr, "Unable to get name info: %s\n", gai_strerror(status));
         goto fail;
     }
-    
-    /* Open socket stream */
-    FILE *rfile = fdopen(rfd, "w+");
-    if (rfile == NULL) {
-            fprintf(stderr, "Unable to fdopen: %s\n", strerror(errno));
-            close(rfd);
-            goto fail;
-    }
-    r->fd = rfd;
-    r->file = rfile;
-    log("Accepted request from %s:%s", r->host, r->port);
+
+    if (!limits_admit(r))
+        goto fail;
+    r->deadline = request_deadline(accepted, HeaderTimeout);
+
+    metrics_connection();
+    metrics_record(METRICS_ACCEPT, accepted);
     return r;
 
 fail:
@@ -63,63 +218,286 @@ fail:
     return NULL;
 }
 
+/**
+ * Open request on a socket that is already connected (such as one end of a
+ * socketpair), for a client without an address.
+ *
+ * The returned request struct must be deallocated using free_request, which
+ * also closes fd.
+ **/
+struct request *open_request(int fd) {
+    struct request *r = request_get();
+
+    if (r == NULL) {
+        fprintf(stderr, "Unable to allocate request: %s\n", strerror(errno));
+        return NULL;
+    }
+    r->fd = fd;
+    snprintf(r->host, sizeof(r->host), "localhost");
+    snprintf(r->port, sizeof(r->port), "0");
+    return r;
+}
+
 /**
  *  * Deallocate request struct.
  *   *
  *    * This function does the following:
  *     *
- *      *  1. Closes the request socket stream or file descriptor.
- *       *  2. Frees all allocated strings in request struct.
- *        *  3. Frees all of the headers (including any allocated fields).
- *         *  4. Frees request struct.
+ *      *  1. Sends what it can of any pending response and closes the socket.
+ *       *  2. Releases everything allocated for the request.
+ *        *  3. Returns the request struct to the request pool.
  *          **/
 void free_request(struct request *r) {
-    struct header *header;
-
     if (r == NULL) {
         return;
     }
 
-    /* Close socket or fd */
-    if(fclose(r->file) != 0)
+    /* Send pending response (without waiting on a non-blocking socket, or
+     * producing more of a body that was cut off), close socket */
+    if (r->fd >= 0) {
+        if (r->body == NULL)
+            response_flush(r);
+        response_discard(r);
         close(r->fd);
-    /* Free allocated strings */
-    free(r->method);
-    free(r->uri);
-    free(r->path);
-    free(r->query);
-
-    struct header *tmp; 
-    header = r->headers;
-    while (header != NULL){
-        tmp = header;
-        header = header->next;
-        free(tmp->name);
-        free(tmp->value);
-        free(tmp);
     }
+    /* Free allocated strings and headers, and stop counting connection */
+    reset_request(r);
+    limits_release(r);
 
     /* Free request */
-    free(r);
+    request_put(r);
     return;
 }
 
+/**
+ * Reset request struct for the next request on the same connection.
+ *
+ * This releases the request's arena (and with it every string and header),
+ * rewinds the parser, and keeps any bytes already received beyond the
+ * current request (the start of the next one) at the front of the receive
+ * buffer.
+ **/
+void reset_request(struct request *r) {
+    r->method = r->uri = r->path = r->query = NULL;
+    r->headers  = NULL;
+    r->nheaders = r->cheaders = 0;
+    memset(r->known, 0, sizeof(r->known));
+    arena_reset(&r->arena);
+
+    if (r->state != PARSE_METHOD)
+        r->requests++;
+    r->skip          += r->content_length;
+    r->content_length = 0;
+    r->started        = 0;
+    r->sent           = 0;
+    r->header_bytes   = 0;
+    r->deadline       = request_deadline(metrics_now(), r->skip ? BodyTimeout : KeepAliveTimeout);
+    r->state      = PARSE_METHOD;
+    r->version    = 0;
+    r->keep_alive = false;
+    r->responded  = false;
+
+    memmove(r->buffer, r->buffer + r->offset, r->length - r->offset);
+    r->length -= r->offset;
+    r->offset  = 0;
+}
+
 /**
  *  * Parse HTTP Request.
  *   *
  *    * This function first parses the request method, any query, and then the
  *     * headers, returning 0 on success, and -1 on error.
+ *     *
+ *     * This blocks until the request is complete or its deadline passes.  If
+ *     * the request was already parsed incrementally by read_request, this
+ *     * simply reports the outcome of that parse.
  *      **/
 int parse_request(struct request *r) {
-    /* Parse HTTP Request Method */
-    int method_status = parse_request_method(r);
-    
-    /* Parse HTTP Requet Headers*/
-    int header_status = parse_request_headers(r);
-    if(method_status == 0 && header_status == 0)
-        return 0;
-    else
-        return -1; 
+    int status;
+
+    if (r->state == PARSE_METHOD || r->state == PARSE_HEADERS) {
+        /* On a blocking socket, read_request only stops early if the client
+         * closes the connection or SO_RCVTIMEO expires: keep waiting until
+         * the deadline */
+        while ((status = read_request(r)) == 0 && !(r->deadline && metrics_now() >= r->deadline));
+
+        if (status <= 0) {
+            bool idle = r->state == PARSE_METHOD && r->offset == r->length;
+            r->state  = idle ? PARSE_CLOSED : status == 0 ? PARSE_TIMEOUT : PARSE_ERROR;
+        }
+    }
+
+    return r->state == PARSE_DONE ? 0 : -1;
+}
+
+/**
+ * Copy the parts of the request parsed so far out of the receive buffer and
+ * into the request's arena, so that the buffer can be compacted.
+ *
+ * This is only needed when a request's headers outgrow the receive buffer.
+ **/
+static int request_evacuate(struct request *r) {
+    char *start = r->buffer;
+    char *end   = r->buffer + r->length;
+
+#define EVACUATE(s) \
+    if ((s) >= start && (s) < end && ((s) = arena_strdup(&r->arena, (s))) == NULL) \
+        return -1
+
+    EVACUATE(r->method);
+    EVACUATE(r->uri);
+    EVACUATE(r->query);
+    for (size_t i = 0; i < r->nheaders; i++) {
+        EVACUATE(r->headers[i].name);
+        EVACUATE(r->headers[i].value);
+    }
+
+#undef EVACUATE
+    return 0;
+}
+
+/**
+ * Read and parse as much of the HTTP Request as is available.
+ *
+ * Bytes are received into the request's buffer, and each complete line is
+ * fed to the request line and header parsers, advancing r->state.  Partial
+ * lines stay in the buffer until the next call, and any bytes beyond the end
+ * of this request (pipelined requests) stay in the buffer for the next
+ * request on the connection (see reset_request).
+ *
+ * The request line and headers may take up to RequestHeaderMax bytes in
+ * all (PARSE_TOO_LARGE), though each line must fit in the receive buffer.
+ * Whenever input arrives after the request's deadline has passed, the
+ * request is abandoned (PARSE_TIMEOUT, or PARSE_CLOSED if only the body of
+ * the previous request was still being received).
+ *
+ * Returns 1 once the request is complete (r->state is PARSE_DONE or one of
+ * the failed states), 0 if the socket has no more data for now, and -1 if
+ * the client closed the connection or the socket failed.
+ **/
+int read_request(struct request *r) {
+    char   *line;
+    char   *end;
+    char   *eol;
+    char   *colon;
+    size_t  skipped;
+    ssize_t nread;
+
+    while (r->state == PARSE_METHOD || r->state == PARSE_HEADERS) {
+        /* Discard body of previous request */
+        skipped    = r->skip < r->length - r->offset ? r->skip : r->length - r->offset;
+        r->offset += skipped;
+        r->skip   -= skipped;
+
+        /* Note when the request's first byte is seen, for metrics, and
+         * give later requests on the connection HeaderTimeout from then */
+        if (r->started == 0 && r->offset < r->length && !r->skip) {
+            r->started = metrics_now();
+            if (r->requests > 0)
+                r->deadline = request_deadline(r->started, HeaderTimeout);
+        }
+
+        /* Feed next complete line to the parser, finding a header's colon
+         * in the same pass as the end of its line */
+        line  = r->buffer + r->offset;
+        end   = r->buffer + r->length;
+        colon = NULL;
+        if (r->skip) {
+            eol = end;
+        } else if (r->state == PARSE_METHOD) {
+            eol = (char *)scan_any(line, end, "\n");
+        } else if ((eol = (char *)scan_any(line, end, ":\n")) < end && *eol == ':') {
+            colon = eol;
+            eol   = (char *)scan_any(colon + 1, end, "\n");
+        }
+
+        if (eol < end) {
+            *eol        = '\0';
+            r->offset   = eol - r->buffer + 1;
+            if ((r->header_bytes += eol - line + 1) > RequestHeaderMax) {
+                r->state = PARSE_TOO_LARGE;
+                break;
+            }
+
+            if (r->state == PARSE_METHOD) {
+                if (line[0] == '\r' || line[0] == '\0')
+                    continue;   /* Tolerate blank lines between requests */
+                r->state = parse_request_method(r, line, eol) == 0 ? PARSE_HEADERS : PARSE_ERROR;
+            } else {
+                switch (parse_request_header(r, line, colon, eol)) {
+                    case 0:  break;
+                    case 1:  r->state = r->nheaders ? PARSE_DONE : PARSE_ERROR; break;
+                    default: r->state = PARSE_ERROR; break;
+                }
+            }
+            continue;
+        }
+
+        /* Make room for more input by discarding consumed lines (once the
+         * request parsed so far no longer points into them) */
+        if (r->offset == r->length && r->state == PARSE_METHOD) {
+            r->offset = r->length = 0;
+        } else if (r->length == sizeof(r->buffer)) {
+            if (r->offset == 0) {
+                debug("request line too long in read_request");
+                r->state = PARSE_TOO_LARGE;
+                break;
+            }
+            if (r->state == PARSE_HEADERS && request_evacuate(r) < 0) {
+                r->state = PARSE_ERROR;
+                break;
+            }
+            memmove(r->buffer, r->buffer + r->offset, r->length - r->offset);
+            r->length -= r->offset;
+            r->offset  = 0;
+        }
+
+        /* Refuse to wait for the rest of a line that is already too long */
+        if (!r->skip && r->header_bytes + (r->length - r->offset) > RequestHeaderMax) {
+            r->state = PARSE_TOO_LARGE;
+            break;
+        }
+
+        /* Receive more input from socket */
+        nread = recv(r->fd, r->buffer + r->length, sizeof(r->buffer) - r->length, 0);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            debug("recv failed in read_request: %s", strerror(errno));
+            return -1;
+        }
+        if (nread == 0) {
+            return -1;
+        }
+        r->length += nread;
+
+        /* Stop listening to clients that trickle in past their deadline */
+        if (r->deadline && (r->started || r->skip) && metrics_now() > r->deadline) {
+            r->state = r->started ? PARSE_TIMEOUT : PARSE_CLOSED;
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Determine whether another complete request is already in the receive
+ * buffer (that is, the client pipelined it behind the current one).
+ *
+ * While this is true, responses are left in the socket stream's buffer so
+ * that consecutive pipelined responses go out together.
+ **/
+bool request_pending(struct request *r) {
+    size_t skipped = r->skip < r->length - r->offset ? r->skip : r->length - r->offset;
+    char  *start   = r->buffer + r->offset + skipped;
+    size_t length  = r->length - r->offset - skipped;
+
+    if (r->skip > skipped)
+        return false;
+    return memmem(start, length, "\n\r\n", 3) != NULL || memmem(start, length, "\n\n", 2) != NULL;
 }
 
 /**
@@ -135,30 +513,49 @@ int parse_request(struct request *r) {
  *           *  GET / HTTP/1.1
  *            *  GET /cgi.script?q=foo HTTP/1.0
  *             *
- *              * This function extracts the method, uri, and query (if it exists).
+ *              * This function extracts the method, uri, and query (if it exists)
+ *              * from a request line that has already been read into buffer (and
+ *              * ends at end).  The buffer is modified in place, and the request
+ *              * points into it.
  *               **/
-int parse_request_method(struct request *r) {
-    char buffer[BUFSIZ];
-    /* Read line from socket */
-    if (fgets(buffer, BUFSIZ, r->file) == NULL) {
-        debug("fgets failed in parse_request_method");
+int parse_request_method(struct request *r, char *buffer, char *end) {
+    char *method  = buffer;
+    char *uri;
+    char *query   = "";
+    char *version = NULL;
+    char *delimiter;
+
+    /* Trim line ending */
+    while (end > buffer && (end[-1] == '\r' || end[-1] == ' '))
+        *--end = '\0';
+
+    /* Parse method and uri (and query), then the version if present */
+    delimiter = (char *)scan_any(method, end, " ");
+    for (uri = delimiter; uri < end && *uri == ' '; uri++)
+        *uri = '\0';
+    if (delimiter == method || uri == end) {
+        debug("malformed request line in parse_request_method");
         goto fail;
     }
-    
-    /* Parse method and uri */
-    char *method = strtok(buffer, WHITESPACE);
-    char *uri    = strtok(NULL, WHITESPACE);
-
-    /* Parse query from uri */
-    char *query = strchr(uri, '?');
-    strtok(uri, "?");
- 
-    r->method = strdup(method);
-    r->uri = strdup(uri);
-    if(query != NULL)
-        r->query = strdup(query+1);
-    else
-        r->query = strdup("");
+
+    delimiter = (char *)scan_any(uri, end, " ?");
+    if (delimiter < end && *delimiter == '?') {
+        *delimiter = '\0';
+        query      = delimiter + 1;
+        delimiter  = (char *)scan_any(query, end, " ");
+    }
+    if (delimiter < end) {
+        for (version = delimiter; version < end && *version == ' '; version++)
+            *version = '\0';
+    }
+
+    /* Parse HTTP version (requests without one are treated as HTTP/1.0) */
+    if (version != NULL && strncmp(version, "HTTP/1.", 7) == 0)
+        r->version = atoi(version + 7);
+
+    r->method = method;
+    r->uri = uri;
+    r->query = query;
 
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
@@ -171,7 +568,7 @@ fail:
 }
 
 /**
- *  * Parse HTTP Request Headers
+ *  * Parse HTTP Request Header
  *   *
  *    * HTTP Headers come in the form:
  *     *
@@ -186,54 +583,95 @@ fail:
  *              *  Accept-Encoding: gzip, deflate
  *               *  Connection: keep-alive
  *                *
- *                 * This function parses the stream from the request socket using the following
+ *                 * This function parses one header line that has already been read
+ *                 * into buffer, given the line's first colon (NULL if it has none)
+ *                 * and its end (modifying it in place, with the header pointing
+ *                 * into it), using the following
  *                  * pseudo-code:
  *                   *
- *                    *  while (buffer = read_from_socket() and buffer is not empty):
- *                     *      name, value = buffer.split(':')
- *                      *      header      = new Header(name, value)
- *                       *      headers.append(header)
+ *                    *  if buffer is empty:
+ *                     *      return end of headers
+ *                      *  name, value = buffer.split(':')
+ *                       *  headers.append(Header(name, value, id(name)))
+ *                        *
+ *                        * Returns 0 if a header was added, 1 if the line is the blank line
+ *                        * that ends the headers, and -1 on error.
  *                        **/
-int parse_request_headers(struct request *r){
-    char buffer[BUFSIZ];
-    char *name;
+int parse_request_header(struct request *r, char *buffer, char *colon, char *end) {
     char *value;
-    /* Parse headers from socket */
     struct header *curr;
-    while (fgets(buffer, BUFSIZ, r->file) && strlen(buffer) > 2){
-        curr = calloc(1, sizeof(struct header));
-        curr->next = NULL; 
-        if(curr == NULL)      //if memory allocation fails
-            goto fail;
-
-        value = skip_whitespace(strchr(buffer, ':')+1);
-        strtok(value, "\r\n");
-        name = strtok(buffer, ":");
-        if (name == NULL)                           // if not it name: value form
-            goto fail;
-
-        curr->name = strdup(name);
-        curr->value = strdup(value);
-        if(r->headers == NULL){
-            r->headers = curr;
-        }    
-        else{
-            curr->next = r->headers;
-            r->headers = curr;
+
+    if (buffer[0] == '\r' || buffer[0] == '\n' || buffer[0] == '\0') {
+        r->keep_alive = request_keep_alive(r);
+#ifndef NDEBUG
+        for (size_t i = 0; i < r->nheaders; i++) {
+            debug("HTTP HEADER %s = %s", r->headers[i].name, r->headers[i].value);
         }
+#endif
+        return 1;
     }
-    if(r->headers == NULL)
-        goto fail;
 
-#ifndef NDEBUG
-    for (struct header *header = r->headers; header != NULL; header = header->next) {
-        debug("HTTP HEADER %s = %s", header->name, header->value);
+    if (colon == NULL || colon == buffer)       // if not it name: value form
+        return -1;
+
+    /* Split name from value, and trim whitespace around value */
+    *colon = '\0';
+    for (value = colon + 1; value < end && (*value == ' ' || *value == '\t'); value++);
+    while (end > value && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *end = '\0';
+
+    /* Grow headers array (within the arena) when full */
+    if (r->nheaders == r->cheaders) {
+        size_t capacity = r->cheaders ? 2 * r->cheaders : REQUEST_HEADERS_MIN;
+        struct header *headers = arena_alloc(&r->arena, capacity * sizeof(struct header));
+        if(headers == NULL || capacity > USHRT_MAX)      //if memory allocation fails
+            return -1;
+        if (r->nheaders)
+            memcpy(headers, r->headers, r->nheaders * sizeof(struct header));
+        r->headers  = headers;
+        r->cheaders = capacity;
     }
-#endif
+
+    curr = &r->headers[r->nheaders++];
+    curr->name  = buffer;
+    curr->value = value;
+    curr->id    = header_lookup(buffer);
+    if (curr->id != HEADER_OTHER && r->known[curr->id] == 0)
+        r->known[curr->id] = r->nheaders;
     return 0;
+}
 
-fail:
-    return -1;
+/**
+ * Determine whether the connection should stay open after this request.
+ *
+ * This also records the request body's Content-Length, so that the body can
+ * be skipped before the next request on the connection is parsed.
+ *
+ * HTTP/1.1 connections are persistent unless the client sends
+ * Connection: close, while HTTP/1.0 connections are only persistent if the
+ * client sends Connection: keep-alive.  Either way, the server closes the
+ * connection once it has handled KeepAliveRequests requests on it.
+ **/
+static bool request_keep_alive(struct request *r) {
+    const char *connection = request_header(r, HEADER_CONNECTION);
+    const char *length     = request_header(r, HEADER_CONTENT_LENGTH);
+
+    if (length != NULL)
+        r->content_length = strtoull(length, NULL, 10);
+
+    if (KeepAliveTimeout == 0)
+        return false;
+    if (KeepAliveRequests > 0 && r->requests + 1 >= KeepAliveRequests)
+        return false;
+    if (request_header(r, HEADER_TRANSFER_ENCODING) != NULL)
+        return false;   /* Cannot find the end of a chunked body */
+
+    if (connection != NULL && strcasestr(connection, "close"))
+        return false;
+    if (connection != NULL && strcasestr(connection, "keep-alive"))
+        return true;
+    return r->version > 0;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,186 @@
+/* resolver.c: Asynchronous Reverse DNS Resolver */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+/* Constants */
+
+#define RESOLVER_SLOTS      1024    /* Cached addresses */
+#define RESOLVER_QUEUE      256     /* Lookups waiting for a resolver thread */
+#define RESOLVER_THREADS    4
+#define RESOLVER_TTL        300     /* Seconds a resolved name is cached */
+#define RESOLVER_RETRY      30      /* Seconds before retrying a pending lookup */
+#define RESOLVER_ADDR_MAX   64      /* Longest numeric address (with IPv6 scope) */
+
+/* Resolver */
+
+typedef enum {
+    HOST_EMPTY,
+    HOST_PENDING,           /**< Lookup queued or in progress */
+    HOST_RESOLVED,          /**< Name (or address, if it has none) cached */
+} host_state;
+
+struct host {
+    char       addr[RESOLVER_ADDR_MAX];     /*< Numeric address */
+    char       name[NI_MAXHOST];            /*< Host name */
+    host_state state;
+    time_t     expires;                     /*< When the entry may be replaced */
+};
+
+struct resolver {
+    struct host     hosts[RESOLVER_SLOTS];                      /*< Direct-mapped cache */
+    char            queue[RESOLVER_QUEUE][RESOLVER_ADDR_MAX];   /*< Ring buffer of addresses */
+    size_t          head;                                       /*< Index of next address */
+    size_t          size;                                       /*< Number of queued addresses */
+    bool            started;                                    /*< Threads started in this process */
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+};
+
+static struct resolver Resolver = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Return cache slot for address.
+ **/
+static struct host *
+resolver_slot(const char *addr)
+{
+    return &Resolver.hosts[hash_string(addr, false) % RESOLVER_SLOTS];
+}
+
+/**
+ * Resolver thread: look up queued addresses and cache their names.
+ **/
+static void *
+resolver_thread(void *arg)
+{
+    struct addrinfo  hints = { .ai_flags = AI_NUMERICHOST, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *ai;
+    struct host     *host;
+    char             addr[RESOLVER_ADDR_MAX];
+    char             name[NI_MAXHOST];
+
+    while (true) {
+        pthread_mutex_lock(&Resolver.lock);
+        while (Resolver.size == 0)
+            pthread_cond_wait(&Resolver.not_empty, &Resolver.lock);
+        memcpy(addr, Resolver.queue[Resolver.head], sizeof(addr));
+        Resolver.head = (Resolver.head + 1) % RESOLVER_QUEUE;
+        Resolver.size--;
+        pthread_mutex_unlock(&Resolver.lock);
+
+        /* Hosts without a name are cached under their address */
+        snprintf(name, sizeof(name), "%s", addr);
+        if (getaddrinfo(addr, NULL, &hints, &ai) == 0) {
+            getnameinfo(ai->ai_addr, ai->ai_addrlen, name, sizeof(name), NULL, 0, NI_NAMEREQD);
+            freeaddrinfo(ai);
+        }
+
+        pthread_mutex_lock(&Resolver.lock);
+        host = resolver_slot(addr);
+        if (host->state == HOST_PENDING && streq(host->addr, addr)) {
+            memcpy(host->name, name, sizeof(name));
+            host->state   = HOST_RESOLVED;
+            host->expires = metrics_now() / 1000000000ULL + RESOLVER_TTL;
+        }
+        pthread_mutex_unlock(&Resolver.lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start resolver threads in this process (must hold Resolver.lock).
+ **/
+static void
+resolver_start(void)
+{
+    pthread_t thread;
+    int       status;
+
+    Resolver.started = true;
+    for (size_t i = 0; i < RESOLVER_THREADS; i++) {
+        if ((status = pthread_create(&thread, NULL, resolver_thread, NULL)) != 0) {
+            fprintf(stderr, "Unable to create resolver thread: %s\n", strerror(status));
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * After fork, the child has none of the resolver threads: forget queued
+ * lookups and start new threads when needed.
+ **/
+static void
+resolver_child(void)
+{
+    pthread_mutex_init(&Resolver.lock, NULL);
+    pthread_cond_init(&Resolver.not_empty, NULL);
+    Resolver.started = false;
+    Resolver.size    = 0;
+    for (size_t i = 0; i < RESOLVER_SLOTS; i++) {
+        if (Resolver.hosts[i].state == HOST_PENDING)
+            Resolver.hosts[i].state = HOST_EMPTY;
+    }
+}
+
+static void __attribute__((constructor))
+resolver_init(void)
+{
+    pthread_atfork(NULL, NULL, resolver_child);
+}
+
+/**
+ * Look up host name of numeric address without blocking.
+ *
+ * If the name is cached, it is copied into name and true is returned.
+ * Otherwise, a lookup is queued for the resolver threads (when
+ * ResolveHostnames is set), the address itself is copied into name, and
+ * false is returned.
+ **/
+bool
+resolve_host(const char *addr, char *name, size_t length)
+{
+    struct host *host;
+    time_t       now;
+    bool         resolved = false;
+
+    snprintf(name, length, "%s", addr);
+    if (!ResolveHostnames || strlen(addr) >= RESOLVER_ADDR_MAX)
+        return false;
+
+    pthread_mutex_lock(&Resolver.lock);
+    host = resolver_slot(addr);
+    now  = metrics_now() / 1000000000ULL;
+
+    if (streq(host->addr, addr) && host->state == HOST_RESOLVED && now < host->expires) {
+        snprintf(name, length, "%s", host->name);
+        resolved = true;
+    } else if (!(streq(host->addr, addr) && host->state == HOST_PENDING && now < host->expires) &&
+               Resolver.size < RESOLVER_QUEUE) {
+        if (!Resolver.started)
+            resolver_start();
+
+        snprintf(host->addr, sizeof(host->addr), "%s", addr);
+        host->state   = HOST_PENDING;
+        host->expires = now + RESOLVER_RETRY;
+
+        snprintf(Resolver.queue[(Resolver.head + Resolver.size) % RESOLVER_QUEUE], RESOLVER_ADDR_MAX, "%s", addr);
+        Resolver.size++;
+        pthread_cond_signal(&Resolver.not_empty);
+    }
+
+    pthread_mutex_unlock(&Resolver.lock);
+    return resolved;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
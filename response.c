@@ -0,0 +1,393 @@
+/* response.c: HTTP Response Buffer */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Return last segment if it lies in the response buffer and ends where the
+ * next copied byte would go (so it can simply be extended), or NULL.
+ **/
+static struct iovec *
+response_tail(struct request *r)
+{
+    struct response_segment *segment;
+    struct iovec *iov;
+
+    if (r->niov == r->iov_head)
+        return NULL;
+
+    iov     = &r->iov[r->niov - 1];
+    segment = &r->segments[r->niov - 1];
+    if (segment->entry != NULL || segment->memory != NULL || segment->fd >= 0 ||
+        (char *)iov->iov_base + iov->iov_len != r->output + r->used)
+        return NULL;
+    return iov;
+}
+
+/**
+ * Add segment for length bytes at data (NULL for a file segment), owned by
+ * nothing yet.  The response is drained first if the segment list is full.
+ * Returns the segment, or NULL if the client can no longer be written to.
+ **/
+static struct response_segment *
+response_segment(struct request *r, const void *data, size_t length)
+{
+    if (r->niov == RESPONSE_IOV_MAX && !response_drain(r))
+        return NULL;
+
+    r->iov[r->niov].iov_base = (void *)data;
+    r->iov[r->niov].iov_len  = length;
+    r->segments[r->niov]     = (struct response_segment){ .fd = -1 };
+    r->sent += length;
+    return &r->segments[r->niov++];
+}
+
+/**
+ * Release segments that have been sent in full (or discarded).
+ **/
+static void
+response_release(struct request *r, size_t count)
+{
+    for (size_t i = r->iov_head; i < r->iov_head + count; i++) {
+        struct response_segment *segment = &r->segments[i];
+
+        if (segment->entry)
+            cache_release(segment->entry);
+        free(segment->memory);
+        if (segment->owned)
+            close(segment->fd);
+        *segment = (struct response_segment){ .fd = -1 };
+    }
+    r->iov_head += count;
+
+    if (r->iov_head == r->niov)
+        r->iov_head = r->niov = r->used = 0;
+}
+
+/**
+ * Stop producing the body, releasing the producer's state.
+ **/
+static void
+response_close_body(struct request *r)
+{
+    const struct response_body *body = r->body;
+
+    r->body = NULL;
+    body->close(r->body_state);
+    r->body_state = NULL;
+}
+
+/**
+ * Copy bytes into the response.
+ *
+ * Bytes are staged in the request's output buffer, where consecutive copies
+ * share a segment.  Once the buffer (or the segment list) is full, the
+ * response so far is sent with response_drain (the event loop sends batched
+ * responses early enough that this never waits on a non-blocking socket, as
+ * longer bodies are referenced, adopted or produced instead).  Returns false
+ * if the client can no longer be written to.
+ **/
+bool
+response_write(struct request *r, const void *data, size_t length)
+{
+    const char   *p = data;
+    struct iovec *iov;
+    size_t        n;
+
+    while (length > 0) {
+        iov = response_tail(r);
+        if (r->used == sizeof(r->output) || (iov == NULL && r->niov == RESPONSE_IOV_MAX)) {
+            if (!response_drain(r))
+                return false;
+            continue;
+        }
+
+        if (iov == NULL) {
+            response_segment(r, r->output + r->used, 0);
+            iov = &r->iov[r->niov - 1];
+        }
+
+        n = sizeof(r->output) - r->used < length ? sizeof(r->output) - r->used : length;
+        memcpy(r->output + r->used, p, n);
+        iov->iov_len += n;
+        r->used      += n;
+        r->sent      += n;
+        p            += n;
+        length       -= n;
+    }
+    return true;
+}
+
+/**
+ * Copy string into the response.
+ **/
+bool
+response_puts(struct request *r, const char *s)
+{
+    return response_write(r, s, strlen(s));
+}
+
+/**
+ * Copy number into the response, in decimal (base 10) or hexadecimal (base
+ * 16).
+ **/
+bool
+response_number(struct request *r, unsigned long long number, unsigned int base)
+{
+    char  digits[3 * sizeof(number)];
+    char *p = digits + sizeof(digits);
+
+    do {
+        *--p    = "0123456789abcdef"[number % base];
+        number /= base;
+    } while (number > 0);
+
+    return response_write(r, p, digits + sizeof(digits) - p);
+}
+
+/**
+ * Add bytes to the response without copying them.
+ *
+ * The bytes must stay valid until they are sent: if entry is not NULL, the
+ * response takes over the caller's reference to it and releases it once
+ * its bytes are sent.  Returns false if the client can no longer be written
+ * to (entry is released regardless).
+ **/
+bool
+response_reference(struct request *r, const void *data, size_t length, struct cache_entry *entry)
+{
+    struct response_segment *segment;
+
+    if ((segment = response_segment(r, data, length)) == NULL) {
+        if (entry)
+            cache_release(entry);
+        return false;
+    }
+    segment->entry = entry;
+    return true;
+}
+
+/**
+ * Add heap allocated bytes to the response without copying them.
+ *
+ * The response takes over data and frees it once sent.  Returns false if
+ * the client can no longer be written to (data is freed regardless).
+ **/
+bool
+response_adopt(struct request *r, void *data, size_t length)
+{
+    struct response_segment *segment;
+
+    if ((segment = response_segment(r, data, length)) == NULL) {
+        free(data);
+        return false;
+    }
+    segment->memory = data;
+    return true;
+}
+
+/**
+ * Add part of a body, as a chunk if chunked, without copying it.
+ *
+ * Like any referenced bytes, data must stay valid until it is sent: body
+ * producers only reuse their buffers once they are called again (see
+ * response_produce).
+ **/
+bool
+response_chunk(struct request *r, const char *data, size_t length, bool chunked)
+{
+    if (length == 0)
+        return true;    /* An empty chunk would end the body */
+
+    if (chunked && !(response_number(r, length, 16) && response_write(r, "\r\n", 2)))
+        return false;
+    if (!response_reference(r, data, length, NULL))
+        return false;
+    return !chunked || response_write(r, "\r\n", 2);
+}
+
+/**
+ * Add count bytes of fd from offset to the response, sent straight from the
+ * page cache (see socket_sendfile) once everything before them is.  Pipes
+ * are spliced instead (offset is ignored), and must supply all count bytes.
+ *
+ * If owned, the response takes over fd and closes it once sent.  Returns
+ * false if the client can no longer be written to (an owned fd is closed
+ * regardless).
+ **/
+bool
+response_sendfile(struct request *r, int fd, off_t offset, size_t count, bool owned)
+{
+    struct response_segment *segment;
+
+    if (count == 0 || (segment = response_segment(r, NULL, count)) == NULL) {
+        if (owned)
+            close(fd);
+        return count == 0;
+    }
+    segment->fd     = fd;
+    segment->owned  = owned;
+    segment->offset = offset;
+    return true;
+}
+
+/**
+ * Produce the rest of the body with body once the response so far is sent.
+ *
+ * Whenever every segment has been sent, response_flush calls body->produce
+ * to queue the next piece of the body (at most a few segments, which may
+ * reference the producer's buffers), until it reports that the body is done
+ * or fails.  Either way, or if the response is discarded, body->close then
+ * releases state.  Bodies are thus produced only as fast as the client
+ * takes them, and can be resumed whenever a non-blocking socket drains.
+ **/
+void
+response_produce(struct request *r, const struct response_body *body, void *state)
+{
+    r->body       = body;
+    r->body_state = state;
+}
+
+/**
+ * Determine whether the response still has a body to produce, or a file to
+ * send, which go out only as fast as the client takes them.
+ **/
+bool
+response_streaming(struct request *r)
+{
+    for (size_t i = r->iov_head; i < r->niov; i++) {
+        if (r->segments[i].fd >= 0)
+            return true;
+    }
+    return r->body != NULL;
+}
+
+/**
+ * Determine whether any of the response is still waiting to be sent.
+ **/
+bool
+response_pending(struct request *r)
+{
+    return r->iov_head < r->niov || r->body != NULL;
+}
+
+/**
+ * Send as much of the response as the socket accepts, producing more of the
+ * body whenever everything before it has been sent.
+ *
+ * Consecutive segments in memory go out with a single sendmsg
+ * (RESPONSE_IOV_MAX is well below IOV_MAX), flagged MSG_MORE if a file
+ * follows so that they share packets with its start, and file segments with
+ * socket_sendfile.  Partially sent segments are advanced so that a later
+ * call resumes where this one stopped.  Returns 1 if the whole response was
+ * sent, 0 if the (non-blocking) socket is full, or -1 on error, in which case
+ * the rest of the response is discarded.
+ **/
+int
+response_flush(struct request *r)
+{
+    struct msghdr message = { 0 };
+    struct response_segment *segment;
+    ssize_t n;
+    size_t  count, end;
+    int     status;
+
+    while (response_pending(r)) {
+        /* Produce more of the body once the rest is sent */
+        if (r->iov_head == r->niov) {
+            if ((status = r->body->produce(r, r->body_state)) != 0)
+                response_close_body(r);
+            if (status < 0) {
+                debug("Unable to produce rest of response to %s:%s", r->host, r->port);
+                response_discard(r);
+                return -1;
+            }
+            continue;
+        }
+
+        /* Send file straight from the page cache (or pipe) */
+        segment = &r->segments[r->iov_head];
+        if (segment->fd >= 0) {
+            if ((n = socket_sendfile(r->fd, segment->fd, segment->offset, r->iov[r->iov_head].iov_len)) <= 0) {
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return 0;
+                debug("sendfile failed: %s", n < 0 ? strerror(errno) : "file ended early");
+                response_discard(r);
+                return -1;
+            }
+            segment->offset             += n;
+            r->iov[r->iov_head].iov_len -= n;
+            if (r->iov[r->iov_head].iov_len == 0)
+                response_release(r, 1);
+            continue;
+        }
+
+        /* Send segments in memory, up to the next file */
+        for (end = r->iov_head; end < r->niov && r->segments[end].fd < 0; end++);
+        message.msg_iov    = r->iov + r->iov_head;
+        message.msg_iovlen = end - r->iov_head;
+        if ((n = sendmsg(r->fd, &message, end < r->niov ? MSG_MORE : 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            debug("sendmsg failed: %s", strerror(errno));
+            response_discard(r);
+            return -1;
+        }
+        metrics_sent(n);
+
+        /* Release segments sent in full, then advance into the next one */
+        for (count = 0; r->iov_head + count < end && (size_t)n >= r->iov[r->iov_head + count].iov_len; count++)
+            n -= r->iov[r->iov_head + count].iov_len;
+        response_release(r, count);
+        if (n > 0) {
+            r->iov[r->iov_head].iov_base  = (char *)r->iov[r->iov_head].iov_base + n;
+            r->iov[r->iov_head].iov_len  -= n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Send the whole response (producing the rest of its body), waiting for the
+ * socket to drain if it is non-blocking.  Returns false on error, or if the client takes none of it
+ * for SendTimeout seconds (in which case the rest is discarded).
+ **/
+bool
+response_drain(struct request *r)
+{
+    struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+    int status;
+
+    while ((status = response_flush(r)) == 0) {
+        if (poll(&pfd, 1, SendTimeout ? (int)SendTimeout * 1000 : -1) == 0) {
+            debug("Timed out sending response to %s:%s", r->host, r->port);
+            response_discard(r);
+            return false;
+        }
+    }
+    return status > 0;
+}
+
+/**
+ * Drop any of the response not yet sent, and stop producing its body.
+ **/
+void
+response_discard(struct request *r)
+{
+    response_release(r, r->niov - r->iov_head);
+    if (r->body != NULL)
+        response_close_body(r);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,175 @@
+/* scan.c: Vectorized Delimiter Scanner */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* Scanner Implementations */
+
+typedef const char *(*scan_function)(const char *p, const char *end, const char *set, size_t n);
+
+/**
+ * Find first byte in set, one byte at a time (or with memchr for a single
+ * byte).
+ **/
+static const char *
+scan_scalar(const char *p, const char *end, const char *set, size_t n)
+{
+    const char *match;
+
+    if (n == 1)
+        return (match = memchr(p, set[0], end - p)) ? match : end;
+
+    for (; p < end; p++) {
+        for (size_t i = 0; i < n; i++) {
+            if (*p == set[i])
+                return p;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * Find first byte in set, 16 bytes at a time with SSE4.2 string compares.
+ *
+ * Once fewer than 16 bytes are left, the last 16 bytes are compared instead:
+ * the bytes compared twice are known not to match.
+ **/
+__attribute__((target("sse4.2")))
+static const char *
+scan_sse42(const char *p, const char *end, const char *set, size_t n)
+{
+    char    delimiters[16] = {0};
+    __m128i needles;
+    int     i;
+
+    if (end - p < 16)
+        return scan_scalar(p, end, set, n);
+
+    memcpy(delimiters, set, n);
+    needles = _mm_loadu_si128((const __m128i *)delimiters);
+
+    while (p < end) {
+        if (end - p < 16)
+            p = end - 16;
+        i = _mm_cmpestri(needles, n, _mm_loadu_si128((const __m128i *)p), 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+        p += 16;
+    }
+    return end;
+}
+
+/**
+ * Find first byte in set, 32 bytes at a time with AVX2 compares.
+ *
+ * As with SSE4.2, the final block overlaps the previous one, and inputs
+ * shorter than 32 bytes are left to SSE4.2.
+ **/
+__attribute__((target("avx2")))
+static const char *
+scan_avx2(const char *p, const char *end, const char *set, size_t n)
+{
+    __m256i  needles[SCAN_SET_MAX];
+    __m256i  block, matches;
+    unsigned mask;
+
+    if (end - p < 32)
+        return scan_sse42(p, end, set, n);
+
+    for (size_t i = 0; i < n; i++)
+        needles[i] = _mm256_set1_epi8(set[i]);
+
+    while (p < end) {
+        if (end - p < 32)
+            p = end - 32;
+        block   = _mm256_loadu_si256((const __m256i *)p);
+        matches = _mm256_cmpeq_epi8(block, needles[0]);
+        for (size_t i = 1; i < n; i++)
+            matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(block, needles[i]));
+
+        if ((mask = _mm256_movemask_epi8(matches)) != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return end;
+}
+
+#endif
+
+/* Scanner Selection: vector scanners are only built for x86, and only
+ * selected if cpuid reports the instructions they need */
+
+static const struct {
+    const char   *name;
+    scan_function scan;
+} Scanners[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2",   scan_avx2   },
+    { "sse4.2", scan_sse42  },
+#endif
+    { "scalar", scan_scalar },
+};
+
+static scan_function Scan = scan_scalar;
+
+/**
+ * Determine whether this CPU can run the named scanner.
+ **/
+static bool
+scan_supported(const char *name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (streq(name, "avx2"))
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+    if (streq(name, "sse4.2"))
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return true;
+}
+
+/**
+ * Select scanner by name, or the fastest one this CPU supports if name is
+ * NULL.  Returns the name of the selected scanner, or NULL if the named
+ * scanner is unknown or unsupported.
+ **/
+const char *
+scan_select(const char *name)
+{
+    for (size_t i = 0; i < sizeof(Scanners) / sizeof(Scanners[0]); i++) {
+        if ((name == NULL || streq(name, Scanners[i].name)) && scan_supported(Scanners[i].name)) {
+            Scan = Scanners[i].scan;
+            return Scanners[i].name;
+        }
+    }
+    return NULL;
+}
+
+static void __attribute__((constructor))
+scan_init(void)
+{
+    scan_select(NULL);
+}
+
+/**
+ * Return pointer to first byte in [p, end) that is one of the n (at most
+ * SCAN_SET_MAX) bytes in set, or end if there is none.
+ *
+ * Use the scan_any macro to pass set as a string literal.
+ **/
+const char *
+scan_bytes(const char *p, const char *end, const char *set, size_t n)
+{
+    return Scan(p, end, set, n);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
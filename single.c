@@ -15,14 +15,13 @@ void
 single_server(int sfd)
 {
     struct request *request;
-    http_status status;
     /* Accept and handle HTTP request */
     while (true) {
         /* Accept request */
         request = accept_request(sfd);
         if (request != NULL){
         /* Handle request */
-            status = handle_request(request);
+            handle_connection(request);
         
             /* Free request */
             free_request(request);
@@ -30,7 +29,6 @@ single_server(int sfd)
     }
     /* Close socket and exit */
     close(sfd);
-    return EXIT_SUCCESS;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,5 +1,7 @@
 /* socket.c: Simple Socket Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
@@ -7,16 +9,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /**
  * Allocate socket, bind it, and listen to specified port.
+ *
+ * If reuseport is set, the socket is marked SO_REUSEPORT before binding so
+ * that several sockets can listen on the same port, with the kernel
+ * distributing incoming connections among them.
  **/
 
-int socket_listen(const char *port)
+static int socket_listen_options(const char *port, bool reuseport)
 {
     struct addrinfo *results;
     int    socket_fd = -1;
@@ -38,10 +47,18 @@ int socket_listen(const char *port)
     /* For each server entry, allocate socket and try to connect */
     for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
     /* Allocate socket */
-    if((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+    if((socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0){
         fprintf(stderr, "Socket Failed: %s\n", strerror(errno)); 
         continue; 
     }
+    /* Share port with other listeners */
+    int enabled = 1;
+    if(reuseport && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) < 0){
+            fprintf(stderr, "Setsockopt Failed: %s\n", strerror(errno)); 
+            close(socket_fd); 
+            socket_fd = -1;
+            continue; 
+    }
     /* Bind socket */
     if(bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0){
             fprintf(stderr, "Bind Failed: %s\n", strerror(errno)); 
@@ -63,5 +80,95 @@ int socket_listen(const char *port)
     return socket_fd;
 }
 
+/**
+ * Allocate exclusive listening socket for specified port.
+ **/
+int socket_listen(const char *port)
+{
+    return socket_listen_options(port, false);
+}
+
+/**
+ * Allocate listening socket for specified port that shares the port with
+ * other SO_REUSEPORT listeners.
+ **/
+int socket_listen_reuseport(const char *port)
+{
+    return socket_listen_options(port, true);
+}
+
+/**
+ * Enable or disable O_NONBLOCK on a file descriptor.
+ *
+ * Returns 0 on success, -1 on error.
+ **/
+int socket_nonblocking(int fd, bool enabled)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(fd, F_SETFL, flags) < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copy count bytes from fd to socket sfd without passing them through user
+ * space where possible.
+ *
+ * Regular files are sent with sendfile(2) starting at offset, and pipes are
+ * spliced with splice(2) (offset is ignored).  If the kernel supports neither
+ * for these descriptors, this falls back to read(2)/write(2).
+ *
+ * Returns the number of bytes sent (less than count if fd ended early, or if
+ * a non-blocking socket filled up part way), or -1 on error (with errno
+ * EAGAIN if a non-blocking socket was full to begin with).
+ **/
+ssize_t socket_sendfile(int sfd, int fd, off_t offset, size_t count)
+{
+    struct stat s;
+    char    buffer[BUFSIZ];
+    size_t  sent = 0;
+    ssize_t n;
+    bool    pipe = fstat(fd, &s) == 0 && S_ISFIFO(s.st_mode);
+    bool    copy = false;
+
+    while (sent < count) {
+        if (copy) {
+            n = pread(fd, buffer, count - sent < sizeof(buffer) ? count - sent : sizeof(buffer), offset);
+            if (n > 0 && (n = write(sfd, buffer, n)) > 0)
+                offset += n;
+        } else if (pipe) {
+            n = splice(fd, NULL, sfd, NULL, count - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = sendfile(sfd, fd, &offset, count - sent);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!copy && !pipe && (errno == EINVAL || errno == ENOSYS)) {
+                copy = true;
+                continue;
+            }
+            if (sent > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        sent += n;
+        metrics_sent(n);
+    }
+
+    return sent;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
 
@@ -3,33 +3,145 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      = "9898";
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
+/* Global Variables (options shared with spidey-bench are in globals.c) */
 mode  ConcurrencyMode = SINGLE;
 char * PROGRAM_NAME = NULL;
 
 void
 usage(const char *progname, int status)
 {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcmMprtwPRkKTHNCVdnfslL]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Threaded, Event, Reactor, or Prefork mode\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -t threads    Number of worker threads (Threaded mode)\n");
+    fprintf(stderr, "    -w n[:cpus]   Number of shards and CPU list to pin them to (Reactor mode)\n");
+    fprintf(stderr, "    -P min:max    Minimum and maximum number of workers (Prefork mode)\n");
+    fprintf(stderr, "    -R requests   Requests per worker before it is recycled (Prefork mode)\n");
+    fprintf(stderr, "    -k seconds    Keep-alive idle timeout (0 disables keep-alive)\n");
+    fprintf(stderr, "    -K requests   Maximum requests per connection (0 = unlimited)\n");
+    fprintf(stderr, "    -T h[:b[:s]]  Seconds to receive headers, to receive a body, and for a send to progress (0 = unlimited)\n");
+    fprintf(stderr, "    -H bytes      Maximum size of request line and headers\n");
+    fprintf(stderr, "    -N max[:per]  Maximum open connections in all and per client (0 = unlimited)\n");
+    fprintf(stderr, "    -C bytes      File cache size (0 disables the cache)\n");
+    fprintf(stderr, "    -V seconds    Interval between revalidations of cached files\n");
+    fprintf(stderr, "    -d entries    Path cache size (0 disables the cache)\n");
+    fprintf(stderr, "    -n            Look up client host names in the background\n");
+    fprintf(stderr, "    -f workers    FastCGI workers per *.fcgi script (0 = one per request)\n");
+    fprintf(stderr, "    -s uri        URI to serve metrics at (\"\" disables)\n");
+    fprintf(stderr, "    -l path       Access log (- is standard error, \"\" disables; reopened on SIGHUP)\n");
+    fprintf(stderr, "    -L policy     When the access log falls behind: drop or block\n");
     exit(status);
 }
 
+/**
+ * SIGHUP handler: reload MIME types and reopen the access log.
+ **/
+void
+hangup(int signum)
+{
+    mime_hangup(signum);
+    accesslog_hangup(signum);
+}
+
+/* Concurrency mode names */
+static const char *ModeNames[] = {
+    [SINGLE]   = "Single",
+    [FORKING]  = "Forking",
+    [THREADED] = "Threaded",
+    [EVENT]    = "Event",
+    [REACTOR]  = "Reactor",
+    [PREFORK]  = "Prefork",
+    [UNKNOWN]  = "Unknown",
+};
+
+/**
+ * Parse concurrency mode from either its name or its numeric value.
+ **/
+mode
+parse_concurrency_mode(const char *s)
+{
+    char *end;
+    long  value = strtol(s, &end, 10);
+
+    if (*s && *end == '\0')
+        return (value >= SINGLE && value < UNKNOWN) ? (mode)value : UNKNOWN;
+
+    for (mode m = SINGLE; m < UNKNOWN; m++) {
+        if (strcasecmp(s, ModeNames[m]) == 0)
+            return m;
+    }
+    return UNKNOWN;
+}
+
+/**
+ * Parse reactor shard specification: a shard count, optionally followed by a
+ * colon and the list of CPUs to pin the shards to (e.g. "4:0,2,4-5").
+ **/
+void
+parse_reactor_shards(char *s)
+{
+    char *cpus = strchr(s, ':');
+
+    if (cpus != NULL) {
+        *cpus = '\0';
+        ReactorCPUs = cpus + 1;
+    }
+    ReactorShards = strtoul(s, NULL, 10);
+}
+
+/**
+ * Parse prefork worker watermarks: "min:max" (or just "min").
+ **/
+void
+parse_prefork_workers(char *s)
+{
+    char *max = strchr(s, ':');
+
+    PreforkMin = strtoul(s, NULL, 10);
+    if (max != NULL)
+        PreforkMax = strtoul(max + 1, NULL, 10);
+}
+
+/**
+ * Parse request timeouts: "header[:body[:send]]" in seconds.
+ **/
+void
+parse_timeouts(char *s)
+{
+    char *end;
+
+    HeaderTimeout = strtoul(s, &end, 10);
+    if (*end == ':')
+        BodyTimeout = strtoul(end + 1, &end, 10);
+    if (*end == ':')
+        SendTimeout = strtoul(end + 1, &end, 10);
+}
+
+/**
+ * Parse connection limits: "max:per-client" (or just "max").
+ **/
+void
+parse_connection_limits(char *s)
+{
+    char *client = strchr(s, ':');
+
+    MaxConnections = strtoul(s, NULL, 10);
+    if (client != NULL)
+        MaxClientConnections = strtoul(client + 1, NULL, 10);
+}
+
 /**
  *  * Parses command line options and starts appropriate server
  *   **/
@@ -44,7 +156,7 @@ main(int argc, char *argv[])
     while (argind < argc && strlen(argv[argind]) > 1 ) {
         char *arg = argv[argind++];
         if (streq(arg, "-c"))
-            ConcurrencyMode = atoi(argv[argind++]);              
+            ConcurrencyMode = parse_concurrency_mode(argv[argind++]);
         else if (streq(arg, "-m"))
             MimeTypesPath = argv[argind++];
         else if (streq(arg, "-M"))
@@ -53,12 +165,73 @@ main(int argc, char *argv[])
             Port = argv[argind++];
         else if (streq(arg, "-r"))
             RootPath = argv[argind++];
+        else if (streq(arg, "-t"))
+            WorkerThreads = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-w"))
+            parse_reactor_shards(argv[argind++]);
+        else if (streq(arg, "-P"))
+            parse_prefork_workers(argv[argind++]);
+        else if (streq(arg, "-R"))
+            PreforkRequests = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-k"))
+            KeepAliveTimeout = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-K"))
+            KeepAliveRequests = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-T"))
+            parse_timeouts(argv[argind++]);
+        else if (streq(arg, "-H"))
+            RequestHeaderMax = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-N"))
+            parse_connection_limits(argv[argind++]);
+        else if (streq(arg, "-C"))
+            CacheBytes = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-V"))
+            CacheRevalidate = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-d"))
+            PathCacheSize = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-n"))
+            ResolveHostnames = true;
+        else if (streq(arg, "-f"))
+            FastCGIWorkers = strtoul(argv[argind++], NULL, 10);
+        else if (streq(arg, "-s"))
+            MetricsURI = argv[argind++];
+        else if (streq(arg, "-l"))
+            AccessLogPath = argv[argind++];
+        else if (streq(arg, "-L") && argind < argc && (streq(argv[argind], "drop") || streq(argv[argind], "block")))
+            AccessLogBlock = streq(argv[argind++], "block");
         else if (streq(arg, "-h"))
             usage(PROGRAM_NAME, 0);
+        else
+            usage(PROGRAM_NAME, 1);
+    }
+
+    if (ConcurrencyMode == UNKNOWN || WorkerThreads == 0 || PreforkMin == 0 || RequestHeaderMax == 0)
+        usage(PROGRAM_NAME, 1);
+
+    /* Ignore SIGPIPE so a vanished client only fails its own write */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Load MIME types (reloaded on SIGHUP) */
+    if (mime_load() < 0) {
+        fprintf(stderr, "Serving every file as %s\n", DefaultMimeType);
+    }
+    signal(SIGHUP, hangup);
+
+    /* Share metrics, the access log, and connection counts with every process
+     * forked from here on */
+    metrics_init();
+    if (!accesslog_init()) {
+        fprintf(stderr, "Not logging requests\n");
+    }
+    if (!limits_init()) {
+        fprintf(stderr, "Not limiting connections\n");
+    }
 
+    /* Listen to server socket (shared with the other shards in Reactor mode) */
+    sfd = ConcurrencyMode == REACTOR ? socket_listen_reuseport(Port) : socket_listen(Port);
+    if (sfd < 0) {
+        fatal("Unable to listen on port %s", Port);
     }
-    /* Listen to server socket */
-    sfd = socket_listen(Port);   
 
     /* Determine real RootPath */
     RootPath  = realpath(RootPath, NULL);
@@ -67,13 +240,22 @@ main(int argc, char *argv[])
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", ConcurrencyMode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", ModeNames[ConcurrencyMode]);
+    debug("WorkerThreads   = %zu", WorkerThreads);
 
-    /* Start either forking or single HTTP server */
+    /* Start appropriate HTTP server */
     if (ConcurrencyMode == SINGLE)
         single_server(sfd);
     else if (ConcurrencyMode == FORKING)
         forking_server(sfd);
+    else if (ConcurrencyMode == THREADED)
+        threaded_server(sfd);
+    else if (ConcurrencyMode == EVENT)
+        event_server(sfd);
+    else if (ConcurrencyMode == REACTOR)
+        reactor_server(sfd);
+    else if (ConcurrencyMode == PREFORK)
+        prefork_server(sfd);
  
     return EXIT_SUCCESS;
 }
@@ -6,11 +6,16 @@
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define RESPONSE_BUFFER_SIZE	(64*1024)
+#define REQUEST_ARENA_SIZE	4096
+#define RESPONSE_IOV_MAX	64
 
 /**
  * Concurrency modes
@@ -18,6 +23,10 @@
 typedef enum {
     SINGLE,     /**< Single connection */
     FORKING,    /**< Process per connection */
+    THREADED,   /**< Worker thread pool */
+    EVENT,      /**< Event loop over non-blocking sockets */
+    REACTOR,    /**< Event loop per CPU over SO_REUSEPORT listeners */
+    PREFORK,    /**< Supervised pool of pre-forked processes */
     UNKNOWN
 } mode;
 
@@ -27,6 +36,28 @@ extern char *Port;                  /**< Port number */
 extern char *MimeTypesPath;         /**< Path to mime.types file */
 extern char *DefaultMimeType;       /**< Default file mimetype */
 extern char *RootPath;              /**< Path to root directory */
+extern size_t WorkerThreads;        /**< Number of threads in worker pool */
+extern size_t ReactorShards;        /**< Number of reactor shards (0 = one per CPU) */
+extern char *ReactorCPUs;           /**< CPU list for pinning reactor shards */
+extern size_t PreforkMin;           /**< Minimum number of pre-forked workers */
+extern size_t PreforkMax;           /**< Maximum number of pre-forked workers */
+extern unsigned long PreforkRequests; /**< Requests before recycling a worker (0 = never) */
+extern unsigned int KeepAliveTimeout; /**< Seconds an idle connection is kept open (0 = no keep-alive) */
+extern unsigned long KeepAliveRequests; /**< Requests per connection (0 = unlimited) */
+extern size_t CacheBytes;           /**< File cache budget in bytes (0 = no cache) */
+extern unsigned int CacheRevalidate; /**< Seconds between revalidations of a cached file */
+extern bool ResolveHostnames;       /**< Look up client host names (for logging and CGI) */
+extern size_t PathCacheSize;        /**< Number of resolved request paths to cache (0 = no cache) */
+extern size_t FastCGIWorkers;       /**< FastCGI workers per script (0 = one per request) */
+extern char *MetricsURI;            /**< URI reserved for metrics (empty = not served) */
+extern char *AccessLogPath;         /**< Path to access log ("-" = standard error, empty = none) */
+extern bool AccessLogBlock;         /**< Wait for room in a full access log ring (instead of dropping) */
+extern unsigned int HeaderTimeout;  /**< Seconds to receive a request's headers (0 = no limit) */
+extern unsigned int BodyTimeout;    /**< Seconds to receive a request's body (0 = no limit) */
+extern unsigned int SendTimeout;    /**< Seconds a response may make no progress (0 = no limit) */
+extern size_t RequestHeaderMax;     /**< Bytes of request line and headers allowed */
+extern unsigned int MaxConnections; /**< Open connections allowed (0 = unlimited) */
+extern unsigned int MaxClientConnections; /**< Open connections allowed per client address (0 = unlimited) */
 
 /* Logging Macros */
 
@@ -39,32 +70,172 @@ extern char *RootPath;              /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Arena */
+
+struct arena {
+    char   *storage;        /*< Caller-owned storage */
+    size_t  capacity;       /*< Size of storage */
+    char   *base;           /*< Current block (storage or latest chunk) */
+    size_t  size;           /*< Size of current block */
+    size_t  used;           /*< Bytes allocated from current block */
+    struct arena_chunk *chunks; /*< Overflow chunks on the heap */
+};
+
+void		    arena_init(struct arena *a, char *storage, size_t capacity);
+void *		    arena_alloc(struct arena *a, size_t size);
+char *		    arena_strdup(struct arena *a, const char *s);
+void		    arena_reset(struct arena *a);
+
 /* HTTP Request */
 
+typedef enum {
+    HEADER_OTHER,           /**< Not a well-known header */
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_HOST,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_RANGE,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_USER_AGENT,
+    HEADER_COUNT
+} header_id;
+
 struct header {
-    char *name;
-    char *value;
+    char     *name;
+    char     *value;
+    header_id id;           /*< Well-known header ID (matched ignoring case) */
+};
+
+typedef enum {
+    PARSE_METHOD,           /**< Waiting for request line */
+    PARSE_HEADERS,          /**< Waiting for header lines */
+    PARSE_DONE,             /**< Request parsed */
+    PARSE_ERROR,            /**< Request malformed */
+    PARSE_CLOSED,           /**< Connection closed or idle before request */
+    PARSE_TIMEOUT,          /**< Request not received by its deadline */
+    PARSE_TOO_LARGE,        /**< Request line or headers exceed RequestHeaderMax */
+} parse_state;
+
+typedef enum {
+    HTTP_STATUS_OK,			/* 200 OK */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
+    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_URI_TOO_LONG,		/* 414 URI Too Long */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
+    HTTP_STATUS_HEADER_FIELDS_TOO_LARGE,	/* 431 Request Header Fields Too Large */
+    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+} http_status;
+
+/* Body produced piece by piece as the client takes it (see response_produce) */
+
+struct request;
+
+struct response_body {
+    int  (*produce)(struct request *request, void *state);  /*< Queue more of body: 1 = done, 0 = more to come, -1 = error */
+    void (*close)(void *state);                             /*< Release state (whether or not body is done) */
+};
 
-    struct header *next;
+/* Owner of a response segment */
+
+struct response_segment {
+    struct cache_entry *entry;  /*< Cache entry owning bytes (or NULL) */
+    void  *memory;              /*< Heap block owning bytes, freed once sent (or NULL) */
+    int    fd;                  /*< File or pipe bytes are sent from (-1 = bytes in memory) */
+    bool   owned;               /*< Close fd once sent */
+    off_t  offset;              /*< Next byte of fd to send */
 };
 
 struct request {
     int   fd;               /*< Client socket file descripter */
-    FILE *file;             /*< Client socket file stream */
-    char *method;           /*< HTTP method */
-    char *uri;              /*< HTTP uniform resource identifier */
-    char *path;             /*< Real path corrsponding to URI and RootPath */
-    char *query;            /*< HTTP query string */
+    char *method;           /*< HTTP method (in buffer or arena) */
+    char *uri;              /*< HTTP uniform resource identifier (in buffer or arena) */
+    char *path;             /*< Real path corrsponding to URI and RootPath (in arena) */
+    char *query;            /*< HTTP query string (in buffer or arena) */
 
     char host[NI_MAXHOST];
     char port[NI_MAXSERV];
 
-    struct header *headers; /*< List of name, value pairs */
+    struct header *headers; /*< Array of name, value pairs in request order (in arena) */
+    size_t nheaders;        /*< Number of headers */
+    size_t cheaders;        /*< Capacity of headers array */
+    unsigned short known[HEADER_COUNT]; /*< Index + 1 of first header with each ID (0 = none) */
+
+    int    version;         /*< HTTP minor version (HTTP/1.<version>) */
+    bool   keep_alive;      /*< Whether connection stays open after response */
+    bool   responded;       /*< Whether response headers have been written */
+    bool   nonblocking;     /*< Whether socket is non-blocking (bodies are produced by the event loop) */
+    http_status status;     /*< Status of response (logged once its body is produced) */
+    unsigned long requests; /*< Number of requests completed on connection */
+    unsigned long long content_length; /*< Length of request body */
+    unsigned long long skip;           /*< Body bytes to discard before next request */
+    unsigned long long started;        /*< Arrival of request's first byte (metrics_now, 0 = none yet) */
+    unsigned long long sent;           /*< Bytes of response so far (headers included) */
+    unsigned long long deadline;       /*< When the request (or previous body) must be in (metrics_now, 0 = none) */
+    size_t header_bytes;    /*< Bytes of request line and headers parsed */
+    unsigned int admitted;  /*< Client counter held against connection limits + 1 (0 = none) */
+
+    bool   closing;         /*< Close connection once response is sent (Event mode) */
+    time_t expires;         /*< Second the connection times out at (Event mode, 0 = not on wheel) */
+    size_t slot;            /*< Timer wheel slot */
+    struct request *prev;   /*< Previous connection in timer wheel slot */
+    struct request *next;   /*< Next connection in timer wheel slot */
+
+    parse_state state;      /*< Incremental parser state */
+    size_t length;          /*< Number of bytes in receive buffer */
+    size_t offset;          /*< Parse position in receive buffer */
+    struct arena arena;     /*< Per-request allocations (reset between requests) */
+    struct request *pool;   /*< Next request in pool of free requests */
+
+    struct iovec iov[RESPONSE_IOV_MAX];         /*< Response segments (in output or referenced) */
+    struct response_segment segments[RESPONSE_IOV_MAX]; /*< Owner of each segment */
+    size_t iov_head;        /*< First segment not yet sent in full */
+    size_t niov;            /*< Number of segments */
+    size_t used;            /*< Bytes of output used by segments */
+    const struct response_body *body;   /*< Produces rest of body once segments are sent (or NULL) */
+    void  *body_state;      /*< State of body */
+
+    /* Storage kept across connections by the request pool */
+    char   buffer[BUFSIZ];                  /*< Receive buffer for incremental parsing */
+    char   scratch[REQUEST_ARENA_SIZE];     /*< Storage for arena */
+    char   output[RESPONSE_BUFFER_SIZE];    /*< Response headers and copied bodies */
 };
 
 struct request *    accept_request(int sfd);
+struct request *    open_request(int fd);
 void		    free_request(struct request *request);
+void		    reset_request(struct request *request);
 int		    parse_request(struct request *request);
+int		    read_request(struct request *request);
+bool		    request_pending(struct request *request);
+const char *	    request_header(struct request *request, header_id id);
+
+/* HTTP Response */
+
+bool		    response_write(struct request *request, const void *data, size_t length);
+bool		    response_puts(struct request *request, const char *s);
+bool		    response_number(struct request *request, unsigned long long number, unsigned int base);
+bool		    response_reference(struct request *request, const void *data, size_t length, struct cache_entry *entry);
+bool		    response_adopt(struct request *request, void *data, size_t length);
+bool		    response_chunk(struct request *request, const char *data, size_t length, bool chunked);
+bool		    response_sendfile(struct request *request, int fd, off_t offset, size_t count, bool owned);
+void		    response_produce(struct request *request, const struct response_body *body, void *state);
+bool		    response_streaming(struct request *request);
+bool		    response_pending(struct request *request);
+int		    response_flush(struct request *request);
+bool		    response_drain(struct request *request);
+void		    response_discard(struct request *request);
 
 /* HTTP Request Handlers */
 
@@ -75,34 +246,210 @@ typedef enum {
     REQUEST_BAD,
 } request_type;
 
+http_status	    handle_request(struct request *request);
+size_t		    handle_connection(struct request *request);
+void		    handle_finish(struct request *request, bool produced);
+
+/* Timer Wheel */
+
+#define TIMER_SLOTS	64
+
+struct timer_wheel {
+    struct request *slots[TIMER_SLOTS];     /*< Connections by expiry second */
+    time_t          current;                /*< Second up to which expiries were collected */
+    size_t          count;                  /*< Connections on the wheel */
+};
+
+void		    timer_init(struct timer_wheel *w);
+void		    timer_schedule(struct timer_wheel *w, struct request *request, time_t expires);
+void		    timer_cancel(struct timer_wheel *w, struct request *request);
+struct request *    timer_expired(struct timer_wheel *w, time_t now);
+
+/* Connection Limits */
+
+bool		    limits_init(void);
+bool		    limits_admit(struct request *request);
+void		    limits_release(struct request *request);
+void		    limits_record(unsigned int *held);
+void		    limits_release_held(unsigned int *held);
+void		    limits_hand_off(struct request *request, pid_t pid);
+void		    limits_reap(pid_t pid, bool released);
+
+/* Metrics */
+
 typedef enum {
-    HTTP_STATUS_OK,			/* 200 OK */
-    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
-    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
-    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
-} http_status;
+    METRICS_ACCEPT,         /**< Setting up an accepted connection */
+    METRICS_PARSE,          /**< Receiving and parsing request headers */
+    METRICS_RESOLVE,        /**< Resolving request path and type */
+    METRICS_REQUEST,        /**< Whole request, from its first byte to its response */
+    METRICS_HANDLER,        /**< Request handler, one stage per request_type */
+    METRICS_STAGES = METRICS_HANDLER + REQUEST_BAD + 1
+} metrics_stage;
 
-http_status	    handle_request(struct request *request);
+bool		    metrics_init(void);
+unsigned long long  metrics_now(void);
+unsigned long long  metrics_record(metrics_stage stage, unsigned long long start);
+void		    metrics_connection(void);
+void		    metrics_status(http_status status);
+void		    metrics_sent(size_t bytes);
+void		    metrics_render(FILE *fs);
+
+/* Access Log */
+
+bool		    accesslog_init(void);
+void		    accesslog_hangup(int signum);
+void		    accesslog_request(struct request *request, http_status status);
+unsigned long long  accesslog_dropped(void);
 
 /* HTTP Server */
 
 void		    single_server(int sfd);
 void		    forking_server(int sfd);
 void		    threaded_server(int sfd);
+void		    event_server(int sfd);
+void		    reactor_server(int sfd);
+void		    prefork_server(int sfd);
+
+/* MIME Types */
+
+int		    mime_load(void);
+void		    mime_hangup(int signum);
+bool		    mime_refresh(void);
+const char *	    determine_mimetype(struct arena *arena, const char *path);
+
+/* Scanner */
+
+#define SCAN_SET_MAX	4
+#define scan_any(p, end, set)	scan_bytes((p), (end), (set), sizeof(set) - 1)
+
+const char *	    scan_select(const char *name);
+const char *	    scan_bytes(const char *p, const char *end, const char *set, size_t n);
+
+/* CGI Scripts */
+
+struct cgi;
+
+struct cgi *	    cgi_open(const char *path, char **envp, bool wait);
+ssize_t		    cgi_read(struct cgi *cgi, char *buffer, size_t size);
+int		    cgi_pipe(struct cgi *cgi);
+void		    cgi_close(struct cgi *cgi);
+
+/* Compression */
+
+struct compressor;
+struct stat;
+
+bool		    compress_accepted(struct request *request);
+bool		    compress_worthy(const char *mimetype, off_t length);
+int		    compress_sibling(const char *path, const struct timespec *mtime, struct stat *s);
+char *		    compress_buffer(const char *data, size_t length, size_t *compressed);
+struct compressor * compress_open(bool chunked);
+int		    compress_write(struct compressor *compressor, struct request *request, const char *data, size_t length, bool flush);
+int		    compress_finish(struct compressor *compressor, struct request *request);
+void		    compress_close(struct compressor *compressor);
+
+/* Directory Listings */
+
+struct listing {
+    char          **names;      /*< Entry names, sorted */
+    size_t          count;      /*< Number of entries */
+    char           *storage;    /*< Packed names */
+    char           *path;       /*< Directory listed */
+    dev_t           dev;        /*< Version of directory listed */
+    ino_t           ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    size_t          refs;       /*< References (the listing cache holds one) */
+};
+
+struct listing *    listing_open(const char *path, const struct stat *s);
+size_t		    listing_render(char *buffer, size_t size, const struct listing *l, size_t *next, size_t last, const char *base);
+void		    listing_close(struct listing *l);
+
+/* Conditional and Range Requests */
+
+#define RANGE_MAX	16
+
+struct validators {
+    char   etag[64];        /*< Strong entity tag (quoted) */
+    char   gzip_etag[64];   /*< Entity tag of gzip variant */
+    char   modified[32];    /*< Last-Modified as an HTTP date */
+    time_t mtime;           /*< Last modification (seconds) */
+};
+
+struct range {
+    off_t  first;           /*< Offset of first byte */
+    off_t  length;          /*< Number of bytes */
+};
+
+void		    conditional_init(struct validators *v, ino_t ino, off_t size, const struct timespec *mtime);
+void		    conditional_headers(struct request *request, const struct validators *v, bool gzip);
+bool		    conditional_fresh(struct request *request, const struct validators *v, bool gzip);
+int		    conditional_ranges(struct request *request, const struct validators *v, off_t size, struct range *ranges, size_t max);
+
+/* Resolver */
+
+bool		    resolve_host(const char *addr, char *name, size_t length);
+
+/* Path Cache */
+
+char *		    resolve_request_path(struct arena *arena, const char *uri, request_type *type);
+
+/* File Cache */
+
+struct cache_entry {
+    char               *path;       /*< Resolved filesystem path */
+    char               *headers;    /*< Response headers, up to the Connection value */
+    size_t              hlength;    /*< Length of headers */
+    char               *body;       /*< File contents */
+    size_t              length;     /*< Length of body */
+    size_t              size;       /*< Size of file (or directory) when loaded */
+    bool                regular;    /*< Body is the file's contents (not rendered from it) */
+    char               *mimetype;   /*< Content-Type of body */
+    struct validators   validators; /*< ETag and Last-Modified */
+    bool                compressible; /*< Worth sending gzip-compressed */
+
+    bool                compressed; /*< Whether the gzip variant was attempted */
+    char               *gzip_headers; /*< Headers of gzip variant (or NULL) */
+    size_t              gzip_hlength;
+    char               *gzip;       /*< Body compressed with gzip (or NULL) */
+    size_t              gzip_length;
+
+    dev_t               dev;        /*< File identity and version when loaded */
+    ino_t               ino;
+    struct timespec     mtime;
+    struct timespec     ctime;
+    time_t              checked;    /*< Last revalidation (monotonic seconds) */
+
+    unsigned int        refs;       /*< Requests using this entry */
+    bool                cached;     /*< Still in the cache (not evicted) */
+    struct cache_entry *chain;      /*< Next entry in hash bucket */
+    struct cache_entry *prev;       /*< Less recently used entry */
+    struct cache_entry *next;       /*< More recently used entry */
+};
+
+struct cache_entry *cache_lookup(const char *path);
+struct cache_entry *cache_insert(const char *path, int fd, const struct stat *s, const char *mimetype);
+struct cache_entry *cache_store(const char *path, const struct stat *s, const char *mimetype, char *body, size_t length);
+bool		    cache_compress(struct cache_entry *entry);
+void		    cache_release(struct cache_entry *entry);
 
 /* Socket */
 
 int		    socket_listen(const char *port);
+int		    socket_listen_reuseport(const char *port);
+int		    socket_nonblocking(int fd, bool enabled);
+ssize_t		    socket_sendfile(int sfd, int fd, off_t offset, size_t count);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *		    determine_mimetype(const char *path);
-char *		    determine_request_path(const char *uri);
+char *		    determine_request_path(struct arena *arena, const char *uri);
 request_type	    determine_request_type(const char *path);
 const char *        http_status_string(http_status status);
+size_t		    hash_string(const char *s, bool fold);
 char *		    skip_nonwhitespace(char *s);
 char *		    skip_whitespace(char *s);
 
@@ -1,39 +1,334 @@
 #!/usr/bin/env python2.7
 
+from __future__ import division, print_function
+
+import getopt
 import multiprocessing
 import os
-import requests
+import random
+import socket
 import sys
 import time
 
+try:
+    from urllib.parse import urlparse
+except ImportError:
+    from urlparse import urlparse
+
 # Globals
 
 PROCESSES = 1
 REQUESTS  = 1
+DURATION  = None
+RATE      = None
+KEEPALIVE = False
+PIPELINE  = 1
+PATHS     = None
 VERBOSE   = False
 URL       = None
 
+PERCENTILES = (50, 90, 99, 99.9)
+
+clock = getattr(time, 'perf_counter', time.time)
+
 # Functions
 
 def usage(status=0):
-    print '''Usage: {} [-p PROCESSES -r REQUESTS -v] URL
+    print('''Usage: {} [options] URL
     -h              Display help message
     -v              Display verbose output
 
-    -p  PROCESSES   Number of processes to utilize (1)
+    -p  PROCESSES   Number of processes, each with one connection (1)
     -r  REQUESTS    Number of requests per process (1)
-    '''.format(os.path.basename(sys.argv[0]))
+    -t  SECONDS     Run for this long instead of a number of requests
+    -R  RATE        Target request rate over all processes (open loop)
+    -k              Keep connections alive between requests
+    -P  DEPTH       Number of requests pipelined per batch (implies -k)
+    -f  FILE        File of paths (and optional weights) to draw requests from
+    '''.format(os.path.basename(sys.argv[0])))
     sys.exit(status)
 
+# HDR Histogram
+
+class Histogram(object):
+    ''' Histogram of integer values (microseconds) with 3 significant digits
+
+    Values below 2048 get a bucket each; above that, every power of two is
+    split into 1024 buckets, so the relative error stays below 0.1%.  Only
+    buckets with counts are stored, so histograms are small and cheap to
+    merge across processes.
+    '''
+    SUB_BUCKETS = 2048
+    HALF        = SUB_BUCKETS // 2
+
+    def __init__(self, counts=None):
+        self.counts = counts or {}
+
+    def index(self, value):
+        if value < self.SUB_BUCKETS:
+            return value
+        shift = value.bit_length() - self.SUB_BUCKETS.bit_length() + 1
+        return self.SUB_BUCKETS + (shift - 1) * self.HALF + (value >> shift) - self.HALF
+
+    def highest(self, index):
+        ''' Return highest value that falls in bucket index '''
+        if index < self.SUB_BUCKETS:
+            return index
+        shift, offset = divmod(index - self.SUB_BUCKETS, self.HALF)
+        shift += 1
+        return ((offset + self.HALF + 1) << shift) - 1
+
+    def record(self, value):
+        i = self.index(max(0, int(value)))
+        self.counts[i] = self.counts.get(i, 0) + 1
+
+    def merge(self, other):
+        for i, n in other.counts.items():
+            self.counts[i] = self.counts.get(i, 0) + n
+
+    def total(self):
+        return sum(self.counts.values())
+
+    def percentile(self, p):
+        total = self.total()
+        if total == 0:
+            return 0
+        target = max(1, int(total * p / 100.0 + 0.5))
+        seen   = 0
+        for i in sorted(self.counts):
+            seen += self.counts[i]
+            if seen >= target:
+                return self.highest(i)
+        return self.highest(max(self.counts))
+
+    def maximum(self):
+        return self.highest(max(self.counts)) if self.counts else 0
+
+# HTTP Client
+
+class Connection(object):
+    ''' HTTP/1.1 client connection that reads whole responses '''
+
+    def __init__(self, host, port):
+        self.sock   = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.buffer = b''
+        self.closed = False
+
+    def fill(self):
+        data = self.sock.recv(65536)
+        if not data:
+            self.closed = True
+            raise EOFError
+        self.buffer += data
+        return len(data)
+
+    def read_until(self, delimiter):
+        start = 0
+        while True:
+            end = self.buffer.find(delimiter, start)
+            if end >= 0:
+                line, self.buffer = self.buffer[:end], self.buffer[end + len(delimiter):]
+                return line
+            start = max(0, len(self.buffer) - len(delimiter) + 1)
+            self.fill()
+
+    def read_exactly(self, length):
+        ''' Read and discard length bytes (without keeping large bodies) '''
+        while len(self.buffer) < length:
+            length     -= len(self.buffer)
+            self.buffer = b''
+            self.fill()
+        self.buffer = self.buffer[length:]
+
+    def read_response(self):
+        ''' Read one response and return its status and size in bytes '''
+        head    = self.read_until(b'\r\n\r\n')
+        lines   = head.split(b'\r\n')
+        status  = int(lines[0].split()[1])
+        headers = {}
+        for line in lines[1:]:
+            name, _, value = line.partition(b':')
+            headers[name.strip().lower()] = value.strip()
+        size = len(head) + 4
+
+        if status == 304 or 100 <= status < 200:
+            pass
+        elif b'content-length' in headers:
+            length = int(headers[b'content-length'])
+            self.read_exactly(length)
+            size += length
+        elif headers.get(b'transfer-encoding', b'').lower() == b'chunked':
+            while True:
+                line   = self.read_until(b'\r\n')
+                length = int(line.split(b';')[0], 16)
+                self.read_exactly(length + 2)
+                size  += len(line) + length + 4
+                if length == 0:
+                    break
+        else:
+            try:
+                while True:
+                    size       += len(self.buffer)
+                    self.buffer = b''
+                    self.fill()
+            except EOFError:
+                pass
+
+        if headers.get(b'connection', b'').lower() == b'close':
+            self.closed = True
+        return status, size
+
+    def close(self):
+        self.sock.close()
+
+def load_paths(path):
+    ''' Load paths and optional weights (one per line) from file '''
+    paths, weights = [], []
+    for line in open(path):
+        fields = line.split('#', 1)[0].split()
+        if fields:
+            paths.append(fields[0])
+            weights.append(float(fields[1]) if len(fields) > 1 else 1.0)
+    return paths, weights
+
+def choose(paths, weights, total):
+    point = random.uniform(0, total)
+    for path, weight in zip(paths, weights):
+        point -= weight
+        if point <= 0:
+            return path
+    return paths[-1]
+
 def do_request(pid):
-    pass
+    ''' Run one connection's share of the load and return its results '''
+    url   = urlparse(URL)
+    host  = url.hostname
+    port  = url.port or 80
+    paths, weights = PATHS or ([url.path or '/'], [1.0])
+    total_weight   = sum(weights)
+    interval  = PROCESSES / RATE if RATE else 0
+    histogram = Histogram()
+    errors    = 0
+    received  = 0
+    completed = 0
+    random.seed(os.getpid())
+
+    def request(path):
+        return 'GET {} HTTP/1.1\r\nHost: {}\r\nConnection: {}\r\n\r\n'.format(
+            path, url.netloc, 'keep-alive' if KEEPALIVE else 'close').encode('latin-1')
+
+    connection = None
+    start      = clock()
+    deadline   = start + DURATION if DURATION else None
+    scheduled  = start + random.uniform(0, interval)
+
+    while (deadline is None and completed + errors < REQUESTS) or (deadline and clock() < deadline):
+        depth = PIPELINE if deadline else min(PIPELINE, REQUESTS - completed - errors)
+
+        # Open loop: wait for the scheduled time, and measure latency from it
+        # (not from when the request was sent), so a stalled server is not
+        # hidden by requests that could not be sent meanwhile.
+        if interval:
+            delay = scheduled - clock()
+            if delay > 0:
+                time.sleep(delay)
+            began      = scheduled
+            scheduled += interval * depth
+        else:
+            began = clock()
+
+        try:
+            if connection is None or connection.closed:
+                if connection:
+                    connection.close()
+                connection = Connection(host, port)
+            connection.sock.sendall(b''.join(request(choose(paths, weights, total_weight)) for _ in range(depth)))
+            for _ in range(depth):
+                if connection.closed:
+                    break   # Server closed after an earlier response: resend the rest
+                status, size = connection.read_response()
+                histogram.record((clock() - began) * 1000000)
+                received += size
+                if status >= 400:
+                    errors += 1
+                else:
+                    completed += 1
+        except (socket.error, EOFError, ValueError, IndexError) as e:
+            if VERBOSE:
+                print('{}: {}'.format(pid, e), file=sys.stderr)
+            errors += 1
+            if connection:
+                connection.close()
+            connection = None
+
+        if not KEEPALIVE and connection:
+            connection.close()
+            connection = None
+
+    if connection:
+        connection.close()
+
+    elapsed = clock() - start
+    if VERBOSE:
+        print('Process {}: {} requests in {:.3f} s'.format(pid, completed, elapsed), file=sys.stderr)
+    return histogram.counts, completed, errors, received, elapsed
+
+def report(results):
+    histogram = Histogram()
+    completed = errors = received = 0
+    elapsed   = 0
+    for counts, c, e, r, t in results:
+        histogram.merge(Histogram(counts))
+        completed += c
+        errors    += e
+        received  += r
+        elapsed    = max(elapsed, t)
+
+    print('Requests:    {} ({} errors)'.format(completed, errors))
+    print('Elapsed:     {:.3f} s'.format(elapsed))
+    print('Throughput:  {:.1f} req/s, {:.2f} MB/s'.format(
+        completed / elapsed if elapsed else 0, received / elapsed / 1000000 if elapsed else 0))
+    print('Latency:     ' + '  '.join('p{:g} {:.3f} ms'.format(p, histogram.percentile(p) / 1000.0) for p in PERCENTILES) +
+          '  max {:.3f} ms'.format(histogram.maximum() / 1000.0))
 
 # Main execution
 
 if __name__ == '__main__':
     # Parse command line arguments
+    try:
+        options, arguments = getopt.getopt(sys.argv[1:], 'hvp:r:t:R:kP:f:')
+    except getopt.GetoptError as e:
+        print(e, file=sys.stderr)
+        usage(1)
+
+    for option, value in options:
+        if option == '-h':
+            usage(0)
+        elif option == '-v':
+            VERBOSE = True
+        elif option == '-p':
+            PROCESSES = int(value)
+        elif option == '-r':
+            REQUESTS = int(value)
+        elif option == '-t':
+            DURATION = float(value)
+        elif option == '-R':
+            RATE = float(value)
+        elif option == '-k':
+            KEEPALIVE = True
+        elif option == '-P':
+            PIPELINE  = int(value)
+            KEEPALIVE = True
+        elif option == '-f':
+            PATHS = load_paths(value)
+
+    if len(arguments) != 1 or PROCESSES < 1 or PIPELINE < 1 or (RATE is not None and RATE <= 0):
+        usage(1)
+    URL = arguments[0]
 
     # Create pool of workers and perform requests
-    pass
+    pool = multiprocessing.Pool(PROCESSES)
+    report(pool.map(do_request, range(PROCESSES)))
 
 # vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,126 @@
+/* threaded.c: Threaded HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define QUEUE_SIZE	1024
+
+/* Connection Queue */
+
+struct queue {
+    struct request *requests[QUEUE_SIZE];   /*< Ring buffer of accepted requests */
+    size_t          head;                   /*< Index of next request to pop */
+    size_t          size;                   /*< Number of queued requests */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+};
+
+static struct queue Queue = {
+    .lock      = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full  = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Push accepted request onto queue, blocking while the queue is full.
+ *
+ * Blocking the acceptor applies backpressure: once every worker is busy and
+ * the queue is full, new connections wait in the kernel's listen backlog.
+ **/
+static void
+queue_push(struct queue *q, struct request *request)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->size == QUEUE_SIZE)
+        pthread_cond_wait(&q->not_full, &q->lock);
+
+    q->requests[(q->head + q->size) % QUEUE_SIZE] = request;
+    q->size++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Pop next request from queue, blocking while the queue is empty.
+ **/
+static struct request *
+queue_pop(struct queue *q)
+{
+    struct request *request;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->size == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+
+    request = q->requests[q->head];
+    q->head = (q->head + 1) % QUEUE_SIZE;
+    q->size--;
+
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return request;
+}
+
+/**
+ * Worker thread: handle requests from the queue forever.
+ **/
+static void *
+threaded_worker(void *arg)
+{
+    struct request *request;
+
+    while (true) {
+        request = queue_pop(&Queue);
+        handle_connection(request);
+        free_request(request);
+    }
+
+    return NULL;
+}
+
+/**
+ * Handle HTTP requests with a fixed pool of worker threads.
+ *
+ * The main thread pre-spawns WorkerThreads workers and then becomes the
+ * acceptor, feeding accepted requests to the workers through a bounded queue.
+ **/
+void
+threaded_server(int sfd)
+{
+    struct request *request;
+    pthread_t thread;
+    int status;
+
+    /* Spawn worker pool */
+    for (size_t i = 0; i < WorkerThreads; i++) {
+        if ((status = pthread_create(&thread, NULL, threaded_worker, NULL)) != 0) {
+            fatal("Unable to create worker thread: %s", strerror(status));
+        }
+        pthread_detach(thread);
+    }
+
+    /* Accept HTTP requests and hand them to the workers */
+    while (true) {
+        request = accept_request(sfd);
+        if (request == NULL) {
+            continue;
+        }
+
+        queue_push(&Queue, request);
+    }
+
+    /* Close server socket */
+    close(sfd);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,96 @@
+/* timer.c: Connection Timer Wheel */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/**
+ * Initialize empty timer wheel.
+ **/
+void
+timer_init(struct timer_wheel *w)
+{
+    memset(w, 0, sizeof(struct timer_wheel));
+}
+
+/**
+ * Remove connection from the wheel (if it is on it).
+ **/
+void
+timer_cancel(struct timer_wheel *w, struct request *r)
+{
+    if (r->expires == 0)
+        return;
+
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        w->slots[r->slot] = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+
+    r->prev = r->next = NULL;
+    r->expires = 0;
+    w->count--;
+}
+
+/**
+ * Schedule connection to expire at second expires (replacing any earlier
+ * schedule).
+ *
+ * Each second has a slot on the wheel, which turns once every TIMER_SLOTS
+ * seconds.  Connections due more than a turn ahead simply stay in their
+ * slot until the wheel comes round to it in the right turn, so scheduling
+ * and cancelling take constant time whatever the timeout.
+ **/
+void
+timer_schedule(struct timer_wheel *w, struct request *r, time_t expires)
+{
+    timer_cancel(w, r);
+
+    if (expires < w->current)
+        expires = w->current;   /* Already due: found by the next timer_expired */
+
+    r->expires = expires;
+    r->slot    = expires % TIMER_SLOTS;
+    r->prev    = NULL;
+    r->next    = w->slots[r->slot];
+    if (r->next)
+        r->next->prev = r;
+    w->slots[r->slot] = r;
+    w->count++;
+}
+
+/**
+ * Remove and return a connection that is due by second now, or NULL once
+ * none is.
+ **/
+struct request *
+timer_expired(struct timer_wheel *w, time_t now)
+{
+    struct request *r;
+
+    if (w->count == 0) {
+        w->current = now;
+        return NULL;
+    }
+
+    /* After a long wait, every slot is visited once */
+    if (now - w->current >= TIMER_SLOTS)
+        w->current = now - TIMER_SLOTS + 1;
+
+    while (w->current <= now) {
+        for (r = w->slots[w->current % TIMER_SLOTS]; r; r = r->next) {
+            if (r->expires <= now) {
+                timer_cancel(w, r);
+                return r;
+            }
+        }
+        if (w->current == now)
+            break;
+        w->current++;
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
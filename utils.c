@@ -9,63 +9,6 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-/**
- * Determine mime-type from file extension
- *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
- *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
- *
- *  <MIMETYPE>      <EXT1> <EXT2> ...
- *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
- *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
- *
- * This function returns an allocated string that must be free'd.
- **/
-
-
-char * determine_mimetype(const char *path) {
-    char *ext;
-    char *mimetype;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
-    
-    /* Find file extension */
-    ext = strrchr(path,'.');//extension...err checking
-    if (ext==NULL)
-        goto fail;
-/* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");//not a 100 % sure with R_ONLY
-    if (fs==NULL)
-        goto fail;
-
-    /* Scan file for matching file extensions */
-   while(fgets(buffer, BUFSIZ, fs)){
-        mimetype = strtok(skip_whitespace(buffer), WHITESPACE);//needs buffer to split up of several tokens(extensions.)
-        if (mimetype == NULL)
-            continue;
-        while ((token=strtok(NULL, WHITESPACE))){
-            if(streq(ext, token))
-                goto done;
-            }
-    }
-fail:
-    mimetype = DefaultMimeType;
-
-done:
-    if (fs) {
-        fclose(fs);
-    }
-    return strdup(mimetype);
-}
-
 /**
  *  * Determine actual filesystem path based on RootPath and URI
  *   *
@@ -75,18 +18,23 @@ done:
  *       * As a security check, if the real path does not begin with the RootPath, then
  *        * return NULL.
  *         *
- *          * Otherwise, return a newly allocated string containing the real path.  This
- *           * string must later be free'd.
- *            **/
-char * determine_request_path(const char *uri){
+ *          * Otherwise, return a string containing the real path, allocated from
+ *           * arena.  If RootPath and the URI together do not fit in a path,
+ *            * return NULL with errno set to ENAMETOOLONG.
+ *             **/
+char * determine_request_path(struct arena *arena, const char *uri){
     char path[BUFSIZ];
     char real[BUFSIZ];
-    sprintf(path, "%s/%s", RootPath, uri);              //combines two paths.
-    realpath(path, real);                               //returns the canonicalized absolute pathname
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", RootPath, uri) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if (realpath(path, real) == NULL)                   //returns the canonicalized absolute pathname
+        return NULL;
     if(strncmp(real, RootPath, strlen(RootPath))!=0)   //compare the bytes of these two.
         return NULL;
 
-    return strdup(real);
+    return arena_strdup(arena, real);
 }
 
 /**
@@ -133,15 +81,36 @@ const char * http_status_string(http_status status){
             case HTTP_STATUS_OK:
                     status_string = "200 OK";
             break;
+            case HTTP_STATUS_PARTIAL_CONTENT:
+                    status_string = "206 Partial Content";
+            break;
+            case HTTP_STATUS_NOT_MODIFIED:
+                    status_string = "304 Not Modified";
+            break;
             case HTTP_STATUS_BAD_REQUEST:
                     status_string = "400 Bad Request";
             break;
             case HTTP_STATUS_NOT_FOUND:
                     status_string = "404 NOT FOUND";
             break;
+            case HTTP_STATUS_REQUEST_TIMEOUT:
+                    status_string = "408 Request Timeout";
+            break;
+            case HTTP_STATUS_URI_TOO_LONG:
+                    status_string = "414 URI Too Long";
+            break;
+            case HTTP_STATUS_RANGE_NOT_SATISFIABLE:
+                    status_string = "416 Range Not Satisfiable";
+            break;
+            case HTTP_STATUS_HEADER_FIELDS_TOO_LARGE:
+                    status_string = "431 Request Header Fields Too Large";
+            break;
             case HTTP_STATUS_INTERNAL_SERVER_ERROR:
                     status_string = "500 Internal Server Error";
             break;
+            case HTTP_STATUS_SERVICE_UNAVAILABLE:
+                    status_string = "503 Service Unavailable";
+            break;
             default:
                     status_string = "451 Unavailable For Legal Reasons";
             break;
@@ -149,6 +118,23 @@ const char * http_status_string(http_status status){
     return status_string;
 }
 
+/**
+ *  * Hash string with FNV-1a
+ *   *
+ *    * If fold is set, letters are hashed as lower-case, so that names that only
+ *     * differ in case hash alike.
+ *      **/
+size_t hash_string(const char *s, bool fold){
+    size_t hash = 2166136261u;
+    unsigned char mask = fold ? 0x20 : 0;
+
+    while (*s) {
+        hash ^= (unsigned char)*s++ | mask;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 /**
  *  * Advance string pointer pass all nonwhitespace characters
  *   **/